@@ -0,0 +1,671 @@
+#include "../bpe/inc/bpe.h"
+
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+typedef struct
+{
+    size_t size;        // corpus size in bytes
+    size_t alphabet;    // distinct characters words are built from
+    size_t words;       // distinct words in the corpus vocabulary
+    double skew;        // zipf exponent for picking words, 0 is uniform
+    uint64_t seed;
+    size_t max_threads; // runs are made for 1, 2, 4, ... up to this many threads
+    size_t max_merges;
+    size_t progress_every; // report training progress on stderr every this many merges, 0 is off
+    size_t merges_per_round;
+    double batch_min_ratio;
+    bool count_local;  // run every thread count with thread local tables merged each round
+    bool count_shared; // and/or with one shared sharded table
+    bool count_dense;  // and/or with thread local dense pair stores
+    bool numa;         // pinned workers with node local corpus slices
+    bool separate_count; // count in a pass of its own instead of during the replacement
+    size_t shards;       // also train with this many shard processes, 0 is off
+    size_t prune_min_freq; // the pruning check drops tokens that occur fewer times than this, the default drops
+                           // some on the default corpus so the rewrite is exercised
+    const char *corpus_path;
+    const char *out_path;
+} bench_config_t;
+
+static uint64_t rng_state;
+
+// splitmix64, so the same seed gives the same corpus on every platform
+static uint64_t rng_next(void)
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double rng_unit(void)
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *generate_corpus(const bench_config_t *config)
+{
+    rng_state = config->seed;
+
+    char *corpus = (char *)malloc(config->size + 1);
+    char **words = (char **)calloc(config->words, sizeof(char *));
+    double *cdf = (double *)malloc(config->words * sizeof(double));
+    if (!corpus || !words || !cdf)
+    {
+        free(corpus);
+        free(words);
+        free(cdf);
+        return NULL;
+    }
+
+    double total = 0;
+    for (size_t i = 0; i < config->words; i++)
+    {
+        size_t word_len = 2 + rng_next() % 9;
+        words[i] = (char *)malloc(word_len + 1);
+        if (!words[i])
+        {
+            for (size_t j = 0; j < i; j++)
+                free(words[j]);
+            free(words);
+            free(cdf);
+            free(corpus);
+            return NULL;
+        }
+
+        // printable characters only, the trainer reads the corpus as a C string
+        for (size_t j = 0; j < word_len; j++)
+            words[i][j] = (char)('!' + rng_next() % config->alphabet);
+        words[i][word_len] = 0;
+
+        total += 1.0 / pow((double)(i + 1), config->skew);
+        cdf[i] = total;
+    }
+
+    size_t pos = 0;
+    size_t words_on_line = 0;
+    while (pos < config->size)
+    {
+        double pick = rng_unit() * total;
+        size_t lo = 0, hi = config->words - 1;
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (cdf[mid] < pick)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        for (const char *c = words[lo]; *c && pos < config->size; c++)
+            corpus[pos++] = *c;
+
+        if (pos < config->size)
+            corpus[pos++] = (++words_on_line % 12) ? ' ' : '\n';
+    }
+    corpus[pos] = 0;
+
+    for (size_t i = 0; i < config->words; i++)
+        free(words[i]);
+    free(words);
+    free(cdf);
+    return corpus;
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return -1;
+    return usage.ru_maxrss;
+}
+
+static bool report_progress(const bpe_train_progress_t *progress, void *user)
+{
+    (void)user;
+    fprintf(stderr, "merge %zu: pair (%u, %u) x%u, %zu distinct pairs, text %zu -> %zu symbols, %.2fs\n",
+            progress->merges, progress->best.pair.a, progress->best.pair.b, progress->best.freq,
+            progress->distinct_pairs, progress->input_bytes, progress->text_size, progress->elapsed);
+    return true;
+}
+
+static void print_worker_array(FILE *out, const char *name, const double *values, size_t len)
+{
+    fprintf(out, ",\"%s\":[", name);
+    for (size_t i = 0; i < len; i++)
+        fprintf(out, "%s%.6f", i ? "," : "", values[i]);
+    fprintf(out, "]");
+}
+
+static void print_table_stats(FILE *out, const char *name, const hash_table_stats_t *stats)
+{
+    fprintf(out,
+            ",\"%s\":{\"buckets\":%zu,\"nodes\":%zu,\"load_factor\":%.3f,\"max_chain\":%zu,\"avg_chain\":%.3f,"
+            "\"resizes\":%zu,\"free_nodes\":%zu,\"bytes\":%zu,\"avg_probe\":%.3f}",
+            name, stats->num_of_buckets, stats->num_of_nodes, stats->load_factor, stats->max_chain_len,
+            stats->avg_chain_len, stats->resize_count, stats->free_nodes, stats->bytes_allocated, stats->avg_probe_len);
+}
+
+static const char *count_mode_names[] = {"local", "shared", "dense"};
+
+typedef struct
+{
+    size_t stream_bytes;  // bpe_tokens_write, varint and remapped
+    size_t archive_bytes; // bpe_archive_write, header included
+    size_t pruned_tokens;
+    size_t pruned_len;
+    bool stream_roundtrip;
+    bool archive_roundtrip;
+    bool prune_roundtrip;
+} format_checks_t;
+
+static bool same_tokens(const uint32_t *one, size_t one_len, const uint32_t *two, size_t two_len)
+{
+    return one_len == two_len && (!one_len || !memcmp(one, two, one_len * sizeof(uint32_t)));
+}
+
+// writes the encoding as a token stream and an archive and reads both back, then prunes the vocabulary and
+// decodes the rewritten encoding against the corpus. the files go next to the corpus and are removed after
+static bool check_formats(const bench_config_t *config, const char *corpus, dyn_arr_t *pair_arr, const uint32_t *encoding,
+                          size_t encoding_len, const bpe_vocab_stats_t *vocab_stats, format_checks_t *checks)
+{
+    memset(checks, 0, sizeof(format_checks_t));
+    size_t path_len = strlen(config->corpus_path);
+    char *path = (char *)malloc(path_len + sizeof(".archive"));
+    if (!path)
+        return false;
+
+    uint32_t *read_tokens;
+    size_t read_len;
+    memcpy(path, config->corpus_path, path_len);
+    memcpy(path + path_len, ".tokens", sizeof(".tokens"));
+    if (bpe_tokens_write(path, encoding, encoding_len, pair_arr->last_index + 1, BPE_PACK_VARINT, true, &checks->stream_bytes) &&
+        bpe_tokens_read(path, &read_tokens, &read_len))
+    {
+        checks->stream_roundtrip = same_tokens(encoding, encoding_len, read_tokens, read_len);
+        free(read_tokens);
+    }
+    remove(path);
+
+    dyn_arr_t *read_pairs;
+    memcpy(path + path_len, ".archive", sizeof(".archive"));
+    if (bpe_archive_write(path, pair_arr, encoding, encoding_len, &checks->archive_bytes) &&
+        bpe_archive_read(path, &read_pairs, &read_tokens, &read_len))
+    {
+        checks->archive_roundtrip = read_pairs->last_index == pair_arr->last_index &&
+                                    !memcmp(pair_vec_data(read_pairs), pair_vec_data(pair_arr), (pair_arr->last_index + 1) * sizeof(pair_t)) &&
+                                    same_tokens(encoding, encoding_len, read_tokens, read_len);
+        free(read_tokens);
+        dyn_arr_free(read_pairs);
+    }
+    remove(path);
+    free(path);
+
+    dyn_arr_t *pruned;
+    uint32_t *old_to_new, *rewritten;
+    size_t rewritten_len;
+    if (bpe_prune(pair_arr, vocab_stats, config->prune_min_freq, &pruned, &old_to_new))
+    {
+        bpe_model_t *model = NULL;
+        size_t corpus_len = strlen(corpus);
+        uint8_t *decoded = (uint8_t *)malloc(corpus_len + 1);
+        if (decoded && bpe_prune_rewrite(pair_arr, old_to_new, encoding, encoding_len, &rewritten, &rewritten_len))
+        {
+            if ((model = bpe_model_create(pruned)))
+            {
+                size_t decoded_len = bpe_decode_into(model, rewritten, rewritten_len, decoded, corpus_len + 1);
+                checks->prune_roundtrip = decoded_len == corpus_len && !memcmp(decoded, corpus, corpus_len);
+            }
+            checks->pruned_tokens = pruned->last_index + 1;
+            checks->pruned_len = rewritten_len;
+            free(rewritten);
+        }
+        bpe_model_free(model);
+        free(decoded);
+        free(old_to_new);
+        dyn_arr_free(pruned);
+    }
+
+    return checks->stream_roundtrip && checks->archive_roundtrip && checks->prune_roundtrip;
+}
+
+// runs in a forked child so peak RSS and the trainer's static state belong to this run alone
+static int run_once(const bench_config_t *config, const char *corpus, size_t thread_no, bpe_count_mode_t count_mode, FILE *out)
+{
+    bpe_train_opts_t opts = {
+        .thread_no = thread_no,
+        .max_merges = config->max_merges,
+        .progress = config->progress_every ? report_progress : NULL,
+        .progress_every = config->progress_every,
+        .merges_per_round = config->merges_per_round,
+        .batch_min_ratio = config->batch_min_ratio,
+        .count_mode = count_mode,
+        .numa = config->numa,
+        .separate_count = config->separate_count,
+    };
+    bpe_train_stats_t stats;
+    bpe_vocab_stats_t vocab_stats;
+    opts.vocab_stats = &vocab_stats;
+    uint32_t *encoding;
+    size_t encoding_len;
+
+    dyn_arr_t *pair_arr = compress_ex(config->corpus_path, &encoding, &encoding_len, &opts, &stats);
+    if (!pair_arr)
+    {
+        fprintf(stderr, "training failed\n");
+        return EXIT_FAILURE;
+    }
+
+    bpe_model_t *model = bpe_model_create(pair_arr);
+    if (!model)
+    {
+        fprintf(stderr, "model creation failed\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t corpus_len = strlen(corpus);
+    uint32_t *encoded;
+    size_t encoded_len;
+    double encode_beg = now();
+    if (!bpe_encode(model, (const uint8_t *)corpus, corpus_len, &encoded, &encoded_len))
+    {
+        fprintf(stderr, "encoding failed\n");
+        return EXIT_FAILURE;
+    }
+    double encode_time = now() - encode_beg;
+
+    bool encode_matches = encoded_len == encoding_len && !memcmp(encoded, encoding, encoded_len * sizeof(uint32_t));
+
+    uint8_t *decoded = (uint8_t *)malloc(corpus_len + 1);
+    if (!decoded)
+        return EXIT_FAILURE;
+
+    double decode_beg = now();
+    size_t decoded_len = bpe_decode_into(model, encoding, encoding_len, decoded, corpus_len + 1);
+    double decode_time = now() - decode_beg;
+
+    bool roundtrip = decoded_len == corpus_len && !memcmp(decoded, corpus, corpus_len);
+
+    // the entropy coded stream plus the merge table is what bpe_archive_write stores, less its header
+    uint8_t *coded;
+    size_t coded_len;
+    uint32_t *uncoded;
+    size_t uncoded_len;
+    double rans_encode_beg = now();
+    if (!bpe_rans_encode(encoding, encoding_len, model->num_of_tokens, &coded, &coded_len))
+    {
+        fprintf(stderr, "rans encoding failed\n");
+        return EXIT_FAILURE;
+    }
+    double rans_encode_time = now() - rans_encode_beg;
+
+    double rans_decode_beg = now();
+    if (!bpe_rans_decode(coded, coded_len, &uncoded, &uncoded_len))
+    {
+        fprintf(stderr, "rans decoding failed\n");
+        return EXIT_FAILURE;
+    }
+    double rans_decode_time = now() - rans_decode_beg;
+
+    roundtrip = roundtrip && uncoded_len == encoding_len && !memcmp(uncoded, encoding, encoding_len * sizeof(uint32_t));
+    size_t merge_table_bytes = (model->num_of_tokens - 256) * sizeof(pair_t);
+
+    format_checks_t checks;
+    bool formats_ok = check_formats(config, corpus, pair_arr, encoding, encoding_len, &vocab_stats, &checks);
+
+    double mb = corpus_len / (1024.0 * 1024.0);
+    fprintf(out,
+            "{\"threads\":%zu,\"count_mode\":\"%s\",\"corpus_bytes\":%zu,\"alphabet\":%zu,\"words\":%zu,\"skew\":%.3f,\"seed\":%llu,"
+            "\"merges_per_round\":%zu,\"merges\":%zu,\"iterations\":%zu,\"distinct_pairs\":%zu,\"tokens\":%zu,"
+            "\"ingest_s\":%.6f,\"count_s\":%.6f,\"merge_s\":%.6f,\"select_s\":%.6f,\"replace_s\":%.6f,\"train_s\":%.6f,"
+            "\"encode_s\":%.6f,\"decode_s\":%.6f,"
+            "\"train_mb_s\":%.3f,\"merges_per_s\":%.1f,\"encode_mb_s\":%.3f,\"decode_mb_s\":%.3f,"
+            "\"coded_bytes\":%zu,\"merge_table_bytes\":%zu,\"compression_ratio\":%.3f,\"rans_encode_mb_s\":%.3f,\"rans_decode_mb_s\":%.3f,"
+            "\"stream_bytes\":%zu,\"archive_bytes\":%zu,\"pruned_tokens\":%zu,\"pruned_len\":%zu,"
+            "\"stream_roundtrip\":%s,\"archive_roundtrip\":%s,\"prune_roundtrip\":%s,"
+            "\"count_table_bytes\":%zu,\"numa_nodes\":%zu,\"fused_rounds\":%zu,\"peak_rss_kb\":%ld,\"encode_matches_train\":%s,\"roundtrip\":%s",
+            thread_no, count_mode_names[count_mode], corpus_len, config->alphabet, config->words, config->skew, (unsigned long long)config->seed,
+            config->merges_per_round ? config->merges_per_round : 1, stats.merges, stats.iterations, stats.distinct_pairs, encoding_len,
+            stats.ingest_time, stats.count_time, stats.merge_time, stats.select_time, stats.replace_time, stats.total_time,
+            encode_time, decode_time,
+            mb / stats.total_time, stats.merges / stats.total_time, mb / encode_time, mb / decode_time,
+            coded_len, merge_table_bytes, (double)corpus_len / (coded_len + merge_table_bytes), mb / rans_encode_time, mb / rans_decode_time,
+            checks.stream_bytes, checks.archive_bytes, checks.pruned_tokens, checks.pruned_len, checks.stream_roundtrip ? "true" : "false",
+            checks.archive_roundtrip ? "true" : "false", checks.prune_roundtrip ? "true" : "false",
+            stats.count_table_bytes, stats.numa_nodes, stats.fused_rounds, peak_rss_kb(), encode_matches ? "true" : "false", roundtrip ? "true" : "false");
+    if (stats.instrumented)
+    {
+        print_worker_array(out, "worker_count_s", stats.worker_count_time, stats.thread_no);
+        print_worker_array(out, "worker_wait_s", stats.worker_wait_time, stats.thread_no);
+        fprintf(out, ",\"worker_pairs\":[");
+        for (size_t i = 0; i < stats.thread_no; i++)
+            fprintf(out, "%s%zu", i ? "," : "", stats.worker_pairs[i]);
+        fprintf(out, "]");
+        print_table_stats(out, "merged_table", &stats.merged_table_stats);
+        print_table_stats(out, "thread_table_0", &stats.thread_table_stats[0]);
+    }
+    fprintf(out, "}\n");
+    fflush(out);
+
+    free(coded);
+    free(uncoded);
+    free(decoded);
+    free(encoded);
+    free(encoding);
+    bpe_vocab_stats_free(&vocab_stats);
+    bpe_model_free(model);
+    dyn_arr_free(pair_arr);
+    return (encode_matches && roundtrip && formats_ok) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static uint64_t token_hash(const bpe_model_t *model, size_t token)
+{
+    // fnv-1a over the token's bytes, ids differ between runs but the bytes of a learned token don't
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const uint8_t *bytes = model->token_bytes + model->token_offset[token];
+    for (uint32_t i = 0; i < model->token_len[token]; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+// trains with config->shards processes and reports the wire traffic next to the usual timings
+static int run_sharded(const bench_config_t *config, const char *corpus, FILE *out)
+{
+    bpe_train_opts_t opts = {
+        .max_merges = config->max_merges,
+        .progress = config->progress_every ? report_progress : NULL,
+        .progress_every = config->progress_every,
+        .merges_per_round = config->merges_per_round,
+        .batch_min_ratio = config->batch_min_ratio,
+    };
+    bpe_train_stats_t stats;
+    uint32_t *encoding;
+    size_t encoding_len;
+
+    dyn_arr_t *pair_arr = compress_sharded(config->corpus_path, config->shards, &encoding, &encoding_len, &opts, &stats);
+    bpe_model_t *model = pair_arr ? bpe_model_create(pair_arr) : NULL;
+    size_t corpus_len = strlen(corpus);
+    uint8_t *decoded = (uint8_t *)malloc(corpus_len + 1);
+    if (!model || !decoded)
+    {
+        fprintf(stderr, "sharded run failed\n");
+        return EXIT_FAILURE;
+    }
+
+    // pairs across slice boundaries are never merged, so the encoder's output can differ; only the roundtrip is checked
+    size_t decoded_len = bpe_decode_into(model, encoding, encoding_len, decoded, corpus_len + 1);
+    bool roundtrip = decoded_len == corpus_len && !memcmp(decoded, corpus, corpus_len);
+
+    double mb = corpus_len / (1024.0 * 1024.0);
+    fprintf(out,
+            "{\"mode\":\"sharded\",\"shards\":%zu,\"corpus_bytes\":%zu,\"merges_per_round\":%zu,\"merges\":%zu,"
+            "\"iterations\":%zu,\"distinct_pairs\":%zu,\"tokens\":%zu,\"train_s\":%.6f,\"train_mb_s\":%.3f,"
+            "\"shard_bytes\":%zu,\"count_table_bytes\":%zu,\"peak_rss_kb\":%ld,\"roundtrip\":%s}\n",
+            config->shards, corpus_len, config->merges_per_round ? config->merges_per_round : 1, stats.merges,
+            stats.iterations, stats.distinct_pairs, encoding_len, stats.total_time, mb / stats.total_time,
+            stats.shard_bytes, stats.count_table_bytes, peak_rss_kb(), roundtrip ? "true" : "false");
+    fflush(out);
+
+    free(decoded);
+    free(encoding);
+    bpe_model_free(model);
+    dyn_arr_free(pair_arr);
+    return roundtrip ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// trains once one merge at a time and once batched, then reports how many learned tokens agree
+static int run_agreement(const bench_config_t *config, FILE *out)
+{
+    bpe_train_opts_t exact_opts = {.thread_no = config->max_threads, .max_merges = config->max_merges};
+    bpe_train_opts_t batch_opts = exact_opts;
+    batch_opts.merges_per_round = config->merges_per_round;
+    batch_opts.batch_min_ratio = config->batch_min_ratio;
+
+    bpe_train_stats_t exact_stats, batch_stats;
+    uint32_t *exact_encoding, *batch_encoding;
+    size_t exact_len, batch_len;
+
+    dyn_arr_t *exact_pairs = compress_ex(config->corpus_path, &exact_encoding, &exact_len, &exact_opts, &exact_stats);
+    dyn_arr_t *batch_pairs = compress_ex(config->corpus_path, &batch_encoding, &batch_len, &batch_opts, &batch_stats);
+    bpe_model_t *exact_model = exact_pairs ? bpe_model_create(exact_pairs) : NULL;
+    bpe_model_t *batch_model = batch_pairs ? bpe_model_create(batch_pairs) : NULL;
+    hash_table_t *exact_tokens = hash_table_create(1024, sizeof(uint64_t), sizeof(uint8_t));
+    if (!exact_model || !batch_model || !exact_tokens)
+    {
+        fprintf(stderr, "agreement run failed\n");
+        return EXIT_FAILURE;
+    }
+
+    uint8_t present = 1;
+    for (size_t token = 256; token < exact_model->num_of_tokens; token++)
+    {
+        uint64_t hash = token_hash(exact_model, token);
+        hash_table_insert(exact_tokens, &hash, &present);
+    }
+
+    size_t shared = 0, common_prefix = 0;
+    bool in_prefix = true;
+    for (size_t token = 256; token < batch_model->num_of_tokens; token++)
+    {
+        uint64_t hash = token_hash(batch_model, token);
+        if (hash_table_search(exact_tokens, &hash, &present))
+            shared++;
+
+        in_prefix = in_prefix && token < exact_model->num_of_tokens && hash == token_hash(exact_model, token);
+        common_prefix += in_prefix;
+    }
+
+    size_t exact_merges = exact_model->num_of_tokens - 256;
+    fprintf(out,
+            "{\"mode\":\"batch_agreement\",\"threads\":%zu,\"merges_per_round\":%zu,\"batch_min_ratio\":%.3f,"
+            "\"exact_merges\":%zu,\"batch_merges\":%zu,\"exact_rounds\":%zu,\"batch_rounds\":%zu,"
+            "\"exact_train_s\":%.6f,\"batch_train_s\":%.6f,\"shared_tokens\":%zu,\"token_agreement\":%.4f,"
+            "\"common_prefix\":%zu,\"exact_symbols\":%zu,\"batch_symbols\":%zu}\n",
+            config->max_threads, config->merges_per_round, config->batch_min_ratio,
+            exact_merges, batch_stats.merges, exact_stats.iterations, batch_stats.iterations,
+            exact_stats.total_time, batch_stats.total_time, shared, exact_merges ? (double)shared / exact_merges : 1.0,
+            common_prefix, exact_len, batch_len);
+    fflush(out);
+
+    hash_table_destroy(exact_tokens);
+    bpe_model_free(exact_model);
+    bpe_model_free(batch_model);
+    dyn_arr_free(exact_pairs);
+    dyn_arr_free(batch_pairs);
+    free(exact_encoding);
+    free(batch_encoding);
+    return EXIT_SUCCESS;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [--size BYTES] [--alphabet N] [--words N] [--skew S] [--seed N]\n"
+            "          [--threads N] [--merges N] [--progress N] [--batch N] [--batch-ratio R]\n"
+            "          [--count local|shared|dense|all] [--numa 0|1] [--separate-count 0|1]\n"
+            "          [--shards N] [--prune-min N] [--corpus PATH] [--out PATH]\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    bench_config_t config = {
+        .size = 1U << 20,
+        .alphabet = 26,
+        .words = 2000,
+        .skew = 1.0,
+        .seed = 42,
+        .max_threads = BPE_MAX_THREAD_NO,
+        .max_merges = 500,
+        .prune_min_freq = 300,
+        .count_local = true,
+        .corpus_path = "bench_corpus.txt",
+        .out_path = NULL,
+    };
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        const char *arg = argv[i];
+        const char *val = argv[++i];
+        if (!strcmp(arg, "--size"))
+            config.size = strtoull(val, NULL, 10);
+        else if (!strcmp(arg, "--alphabet"))
+            config.alphabet = strtoull(val, NULL, 10);
+        else if (!strcmp(arg, "--words"))
+            config.words = strtoull(val, NULL, 10);
+        else if (!strcmp(arg, "--skew"))
+            config.skew = strtod(val, NULL);
+        else if (!strcmp(arg, "--seed"))
+            config.seed = strtoull(val, NULL, 10);
+        else if (!strcmp(arg, "--threads"))
+            config.max_threads = strtoull(val, NULL, 10);
+        else if (!strcmp(arg, "--merges"))
+            config.max_merges = strtoull(val, NULL, 10);
+        else if (!strcmp(arg, "--progress"))
+            config.progress_every = strtoull(val, NULL, 10);
+        else if (!strcmp(arg, "--batch"))
+            config.merges_per_round = strtoull(val, NULL, 10);
+        else if (!strcmp(arg, "--batch-ratio"))
+            config.batch_min_ratio = strtod(val, NULL);
+        else if (!strcmp(arg, "--count"))
+        {
+            config.count_local = !strcmp(val, "local") || !strcmp(val, "all");
+            config.count_shared = !strcmp(val, "shared") || !strcmp(val, "all");
+            config.count_dense = !strcmp(val, "dense") || !strcmp(val, "all");
+        }
+        else if (!strcmp(arg, "--numa"))
+            config.numa = strtoull(val, NULL, 10) != 0;
+        else if (!strcmp(arg, "--separate-count"))
+            config.separate_count = strtoull(val, NULL, 10) != 0;
+        else if (!strcmp(arg, "--shards"))
+            config.shards = strtoull(val, NULL, 10);
+        else if (!strcmp(arg, "--prune-min"))
+            config.prune_min_freq = strtoull(val, NULL, 10);
+        else if (!strcmp(arg, "--corpus"))
+            config.corpus_path = val;
+        else if (!strcmp(arg, "--out"))
+            config.out_path = val;
+        else
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (config.size < 2 || !config.words || !config.alphabet || config.alphabet > 94 || !config.max_threads ||
+        config.max_threads > BPE_MAX_THREAD_NO || config.shards > BPE_MAX_SHARDS ||
+        (!config.count_local && !config.count_shared && !config.count_dense))
+    {
+        fprintf(stderr, "Invalid configuration\n");
+        return EXIT_FAILURE;
+    }
+
+    char *corpus = generate_corpus(&config);
+    if (!corpus)
+    {
+        fprintf(stderr, "Failed to generate corpus\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE *corpus_file = fopen(config.corpus_path, "w");
+    if (!corpus_file)
+    {
+        perror("fopen");
+        free(corpus);
+        return EXIT_FAILURE;
+    }
+    fputs(corpus, corpus_file);
+    fclose(corpus_file);
+
+    FILE *out = stdout;
+    if (config.out_path && !(out = fopen(config.out_path, "w")))
+    {
+        perror("fopen");
+        free(corpus);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    for (size_t thread_no = 1;; thread_no = thread_no * 2 < config.max_threads ? thread_no * 2 : config.max_threads)
+    {
+        for (int mode = BPE_COUNT_LOCAL_MERGE; mode <= BPE_COUNT_DENSE; mode++)
+        {
+            if ((mode == BPE_COUNT_LOCAL_MERGE && !config.count_local) || (mode == BPE_COUNT_SHARED && !config.count_shared) ||
+                (mode == BPE_COUNT_DENSE && !config.count_dense))
+                continue;
+
+            fflush(out);
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                perror("fork");
+                status = EXIT_FAILURE;
+                break;
+            }
+
+            if (!pid)
+                _exit(run_once(&config, corpus, thread_no, (bpe_count_mode_t)mode, out));
+
+            int child_status;
+            if (waitpid(pid, &child_status, 0) < 0 || !WIFEXITED(child_status) || WEXITSTATUS(child_status))
+            {
+                fprintf(stderr, "run with %zu threads failed\n", thread_no);
+                status = EXIT_FAILURE;
+            }
+        }
+
+        if (thread_no == config.max_threads)
+            break;
+    }
+
+    if (config.merges_per_round > 1)
+    {
+        fflush(out);
+        pid_t pid = fork();
+        if (!pid)
+            _exit(run_agreement(&config, out));
+
+        int child_status;
+        if (pid < 0 || waitpid(pid, &child_status, 0) < 0 || !WIFEXITED(child_status) || WEXITSTATUS(child_status))
+        {
+            fprintf(stderr, "batch agreement run failed\n");
+            status = EXIT_FAILURE;
+        }
+    }
+
+    if (config.shards)
+    {
+        fflush(out);
+        pid_t pid = fork();
+        if (!pid)
+            _exit(run_sharded(&config, corpus, out));
+
+        int child_status;
+        if (pid < 0 || waitpid(pid, &child_status, 0) < 0 || !WIFEXITED(child_status) || WEXITSTATUS(child_status))
+        {
+            fprintf(stderr, "sharded run failed\n");
+            status = EXIT_FAILURE;
+        }
+    }
+
+    if (out != stdout)
+        fclose(out);
+    free(corpus);
+    return status;
+}
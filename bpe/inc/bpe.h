@@ -7,9 +7,11 @@
 #include <stdint.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 
 #include "../../dyn_arr/inc/dyn_arr.h"
 #include "../../hash_table/inc/hash_table.h"
+#include "../../hash_table/inc/sharded_hash_table.h"
 
 typedef struct
 {
@@ -22,18 +24,331 @@ typedef struct
     uint32_t freq;
 } pair_freq_t;
 
+DYN_ARR_DEFINE_TYPED(pair_vec, pair_t)
+DYN_ARR_DEFINE_TYPED(pair_freq_vec, pair_freq_t)
+
+#define PAIR_STORE_EMPTY UINT32_MAX
+
+typedef struct
+{
+    uint32_t b; // PAIR_STORE_EMPTY marks a free slot
+    uint32_t value;
+} pair_slot_t;
+
+// open addressed map from the second symbol of a pair to its value
+typedef struct
+{
+    pair_slot_t *slots;
+    uint32_t len;
+    uint32_t mask; // capacity - 1, the capacity is a power of two
+} pair_row_t;
+
+// pair_t -> uint32_t map laid out as one row per first symbol; symbols are handed out densely from 0,
+// so a lookup is an index into rows plus a probe in a small table instead of hashing both symbols
+typedef struct
+{
+    pair_row_t *rows;
+    size_t num_of_rows; // grows to cover the largest first symbol added
+    size_t num_of_pairs;
+} pair_store_t;
+
+// flattened view of a merge table, built once so decoding never has to walk the merge tree
+typedef struct
+{
+    dyn_arr_t *pair_arr;   // merge table the model was built from (not owned)
+    size_t num_of_tokens;  // pair_arr->last_index + 1
+    uint32_t *token_len;   // byte length of each token
+    size_t *token_offset;  // offset of each token's bytes inside token_bytes
+    uint8_t *token_bytes;  // bytes of every token laid out back to back
+    size_t bytes_len;      // total size of token_bytes
+    pair_store_t *rank_store; // pair -> id of the token the pair merges into, used by the encoder
+    // training frequencies, NULL unless bpe_model_attach_stats was called
+    uint32_t *merge_freq; // count of each token's pair when it was merged
+    size_t *token_freq;   // occurrences of each token in the training encoding
+    float *token_bits;    // -log2 of each token's share of the encoding, its cost in an ideal entropy coder
+} bpe_model_t;
+
+// frequencies seen in training, indexed by token id
+typedef struct
+{
+    size_t num_of_tokens;
+    uint32_t *merge_freq;  // count of the pair when it was merged, 0 for the bytes and for loaded merges
+    size_t merge_cap;
+    size_t *token_freq;    // occurrences of each token in the final encoding
+    size_t total_tokens;   // length of the final encoding
+} bpe_vocab_stats_t;
+
+#define BPE_MAX_THREAD_NO 16
+#define BPE_MAX_NUMA_NODES 64
+#define BPE_MAX_SHARDS 64
+// bpe_select_batch ranks this many candidates per merge it may pick
+#define BPE_BATCH_CANDIDATE_FACTOR 4
+
+// where each training worker runs, read from the sysfs node topology
+typedef struct
+{
+    size_t num_of_nodes;
+    int worker_node[BPE_MAX_THREAD_NO];
+    int worker_cpu[BPE_MAX_THREAD_NO]; // -1 when the topology is unknown and the worker isn't pinned
+} bpe_numa_plan_t;
+
+// snapshot handed to the progress callback after each reported merge
+typedef struct
+{
+    size_t iteration;
+    size_t merges;
+    size_t distinct_pairs; // distinct adjacent pairs counted this round
+    pair_freq_t best;      // pair merged this round
+    size_t text_size;      // symbols left in the text
+    size_t input_bytes;
+    double elapsed; // seconds since training started
+} bpe_train_progress_t;
+
+// how the workers count pairs each round
+typedef enum
+{
+    BPE_COUNT_LOCAL_MERGE = 0, // each worker fills its own table, merged into one after every round
+    BPE_COUNT_SHARED,          // workers add straight into one lock-striped table, no merge and no duplicate keys
+    BPE_COUNT_DENSE,           // each worker fills its own pair_store_t, summed into the first one after every round
+} bpe_count_mode_t;
+
+// how bpe_tokens_write packs token ids
+typedef enum
+{
+    BPE_PACK_VARINT = 0, // 7 bits a byte, ids below 128 take a single byte
+    BPE_PACK_FIXED,      // every id in the same number of bits, just enough for the largest id
+} bpe_pack_mode_t;
+
+// vocabulary dump formats for bpe_vocab_export
+typedef enum
+{
+    BPE_VOCAB_TEXT = 0, // "id => bytes" lines, bytes escaped C style
+    BPE_VOCAB_JSON,     // {"tokens":[{"id", "bytes", "pair", "merge_freq", "token_freq"}, ...]}
+    BPE_VOCAB_BINARY,   // header, uint32_t byte length of every token, then the bytes back to back
+} bpe_vocab_format_t;
+
+// merge graph formats for bpe_graph_export, every merged token has an edge to each of its two parts, bytes included
+typedef enum
+{
+    BPE_GRAPH_DOT = 0,
+    BPE_GRAPH_GRAPHML,
+    BPE_GRAPH_JSON, // {"nodes":[{"id", "depth", "fan_in"}, ...], "edges":[[token, part, 0 left or 1 right], ...]}
+} bpe_graph_format_t;
+
+// shape of the merge graph, depths count merges down to the bytes (a byte is 0, a pair of bytes 1)
+typedef struct
+{
+    size_t num_of_merges;
+    uint32_t max_depth;
+    double avg_depth;          // over the merged tokens
+    uint32_t max_fan_in;       // most merges that use one token as a part
+    uint32_t max_fan_in_token;
+    size_t num_of_roots;       // merged tokens no later merge builds on
+} bpe_graph_stats_t;
+
+// return false to stop training early, the merges made so far are kept
+typedef bool (*bpe_progress_cb)(const bpe_train_progress_t *progress, void *user);
+
+typedef struct
+{
+    size_t thread_no;  // worker threads used for counting, 0 or anything above BPE_MAX_THREAD_NO means BPE_MAX_THREAD_NO
+    // stop once the table holds this many merges, base and resumed ones included; 0 means train until no
+    // pair occurs more than once
+    size_t max_merges;
+    bpe_progress_cb progress;
+    size_t progress_every; // call progress every this many iterations, 0 means every iteration
+    void *progress_user;
+    // merges committed per counting round, 0 or 1 trains one merge at a time
+    size_t merges_per_round;
+    // 0 only batches pairs whose merge order can't differ from one-at-a-time training (up to ties);
+    // above 0 it skips pairs that share a symbol and takes any pair counted at least this fraction of the best
+    double batch_min_ratio;
+    bpe_count_mode_t count_mode;
+    // pin workers to cores node by node and have each one first touch and count a fixed slice of the
+    // corpus, so counting reads node local memory on multi-socket machines. the text is compacted after
+    // every round and the slices are taken again from the shorter text, so a worker's slice drifts onto
+    // pages the workers before it touched. the fixed slices are kept for the first rounds, the longest
+    // ones, and counting goes back to dynamic chunks once the text has shrunk by half a slice
+    bool numa;
+    // count every round's pairs in a pass of its own instead of while the previous round's replacement
+    // writes the text, mostly for comparing the two
+    bool separate_count;
+    // every checkpoint_every merges the merges so far and the current text are written to checkpoint_path
+    // by a background thread; with resume set, training picks up from the checkpoint there if it was made
+    // from the same corpus
+    const char *checkpoint_path;
+    size_t checkpoint_every;
+    bool resume;
+    // merge table to extend (e.g. from read_pairs): the corpus is encoded with it first and training carries
+    // on from its next free symbol, so only the new merges are paid for. ignored when resuming from a checkpoint
+    dyn_arr_t *base_pairs;
+    // when set, overwritten with the frequency of every merge and of every token in the encoding; free it with
+    // bpe_vocab_stats_free
+    bpe_vocab_stats_t *vocab_stats;
+} bpe_train_opts_t;
+
+// wall clock seconds spent in each phase of a compress_ex() run
+typedef struct
+{
+    double ingest_time;  // reading the file and widening it to symbols
+    double count_time;   // workers counting pairs
+    double merge_time;   // hash_table_merge of the per-thread tables, 0 with BPE_COUNT_SHARED
+    double select_time;  // flattening the merged table and picking the best pair
+    double replace_time; // rewriting the text with the new symbol, and counting the next round's pairs when fused
+    double total_time;
+    size_t input_bytes;
+    size_t output_len; // symbols left in the encoding
+    size_t merges;
+    size_t iterations;
+    size_t distinct_pairs; // distinct pairs seen in the last counting round
+    size_t count_table_bytes; // most memory the counting tables held at once, per-thread and merged tables together
+    size_t numa_nodes;        // nodes the workers were spread over, 0 unless opts->numa was set
+    size_t fused_rounds;      // rounds whose counts came out of the previous replacement pass, with no count pass
+    size_t resumed_merges;    // merges loaded from the checkpoint instead of trained
+    size_t base_merges;       // merges taken from opts->base_pairs
+    size_t checkpoints;       // checkpoints written
+    size_t shards;            // processes the corpus was split over, 0 unless trained with compress_sharded
+    size_t shard_bytes;       // count table bytes the coordinator received from the shards
+
+    // per worker counters, only filled when built with BPE_INSTRUMENT
+    bool instrumented;
+    size_t thread_no;
+    double worker_count_time[BPE_MAX_THREAD_NO]; // time spent counting
+    double worker_wait_time[BPE_MAX_THREAD_NO];  // time spent at the end of round barrier waiting for the others
+    size_t worker_pairs[BPE_MAX_THREAD_NO];      // pairs counted
+    // table shapes from the round with the most distinct pairs, for sizing the initial bucket counts
+    hash_table_stats_t merged_table_stats; // the shards summed up with BPE_COUNT_SHARED
+    hash_table_stats_t thread_table_stats[BPE_MAX_THREAD_NO];
+} bpe_train_stats_t;
+
 char *get_file(const char *path);
 bool dump_pairs(const char *path, dyn_arr_t *pair_arr);
 dyn_arr_t *read_pairs(const char *path);
 
 void print_text(const uint32_t *text, int length);
-void print_graph(dyn_arr_t *pair_arr, const char *png_name, bool add_ascii);
+// writes the merge graph as DOT to dot_path, rendering it (dot -Tpng) is left to the caller
+bool print_graph(dyn_arr_t *pair_arr, const char *dot_path, bool add_ascii);
 
 dyn_arr_t *compress(const char *path, uint32_t **encoding, size_t *len);
+// opts and stats may be NULL
+dyn_arr_t *compress_ex(const char *path, uint32_t **encoding, size_t *len, const bpe_train_opts_t *opts, bpe_train_stats_t *stats);
 char *decompress(uint32_t *encoding, size_t len, dyn_arr_t *pair_arr);
 void render_pairs(dyn_arr_t *pair_arr);
 char *resolve_pair(uint32_t pair_index, dyn_arr_t *pair_arr, hash_table_t *memoization_table);
 
 bool is_less(const void *a, const void *b);
+// by count, ties ranked by pair so the lowest pair is the largest
+bool pair_freq_less(const void *a, const void *b);
+// picks up to k pairs to merge in one round out of the len counted pairs, best first, into batch. every pair's
+// symbols must be below symbol_limit; cands holds k * BPE_BATCH_CANDIDATE_FACTOR entries and symbol_info
+// 3 * symbol_limit. shared by compress_ex and the shard coordinator so both pick the same merges from the same counts
+void bpe_select_batch(const pair_freq_t *nodes, size_t len, size_t k, double min_ratio, uint32_t symbol_limit, pair_freq_t *cands,
+                      uint32_t *symbol_info, pair_freq_t *batch, size_t *batch_len);
+
+pair_store_t *pair_store_create(size_t num_of_rows);
+void pair_store_free(pair_store_t *store);
+bool pair_store_add(pair_store_t *store, pair_t pair, uint32_t delta); // inserts the pair with delta if it is new
+bool pair_store_set(pair_store_t *store, pair_t pair, uint32_t value);
+bool pair_store_get(const pair_store_t *store, pair_t pair, uint32_t *value);
+bool pair_store_merge(pair_store_t *dst, const pair_store_t *src); // adds every value of src into dst
+void pair_store_clear(pair_store_t *store);                        // keeps the allocations for reuse
+size_t pair_store_bytes(const pair_store_t *store);
+
+uint64_t bpe_corpus_hash(const uint8_t *bytes, size_t len);
+// writes to path.tmp and renames it over path once it is synced, so path always holds a complete checkpoint
+bool bpe_checkpoint_write(const char *path, const pair_t *merges, size_t num_merges, const uint32_t *text, size_t text_size,
+                          uint64_t input_bytes, uint64_t corpus_hash);
+// fails unless the checkpoint was made from a corpus of input_bytes bytes hashing to corpus_hash and every
+// text symbol is a byte or one of its merges
+bool bpe_checkpoint_read(const char *path, uint64_t input_bytes, uint64_t corpus_hash, pair_t **merges, size_t *num_merges,
+                         uint32_t **text, size_t *text_size);
+
+// background checkpoint writer, submit copies the state and returns without touching the disk
+typedef struct bpe_checkpointer bpe_checkpointer_t;
+bpe_checkpointer_t *bpe_checkpointer_start(const char *path);
+// false if the previous checkpoint is still being written (this one is skipped) or the copy failed
+bool bpe_checkpointer_submit(bpe_checkpointer_t *ckpt, const pair_t *merges, size_t num_merges, const uint32_t *text,
+                             size_t text_size, uint64_t input_bytes, uint64_t corpus_hash);
+// waits for a pending write; false if any write failed
+bool bpe_checkpointer_stop(bpe_checkpointer_t *ckpt, size_t *written);
+
+// spreads thread_no workers over the nodes with cpus, a single unpinned node if the topology can't be read
+bool bpe_numa_plan(size_t thread_no, bpe_numa_plan_t *plan);
+bool bpe_numa_pin_self(int cpu);
+
+// count tables on the wire: rows of pairs with the same first symbol in ascending order, symbols as gaps from
+// the previous one and counts as zigzag varints. with prev the table carries store - prev, pairs gone from store
+// included, so a shard only sends what a round changed. unpack adds the counts into store, deltas included, and
+// fails on a pair with a symbol at or past symbol_limit
+bool bpe_counts_pack(const pair_store_t *store, const pair_store_t *prev, uint8_t **buf, size_t *len);
+bool bpe_counts_unpack(const uint8_t *buf, size_t len, uint32_t symbol_limit, pair_store_t *store);
+
+// multi process training. a shard counts the pairs of its slice of the corpus and sends the change in counts
+// every round, the coordinator sums them up, picks the round's merges like compress_ex and sends them to every
+// shard to apply locally. the two talk over one connected stream socket per shard, a socket pair for local
+// processes or a unix or tcp socket between machines
+bool bpe_shard_serve(int fd, const uint8_t *bytes, size_t len);
+// the shards' final texts are concatenated into encoding in fds order; uses the max_merges, merges_per_round,
+// batch_min_ratio, progress and vocab_stats fields of opts
+dyn_arr_t *bpe_shard_coordinate(const int *fds, size_t num_of_shards, uint32_t **encoding, size_t *len, const bpe_train_opts_t *opts,
+                                bpe_train_stats_t *stats);
+// forks num_of_shards local shards over socket pairs. the file is split at whitespace and pairs spanning
+// two slices are never counted or merged, so the result is close to but not the same as compress_ex's
+dyn_arr_t *compress_sharded(const char *path, size_t num_of_shards, uint32_t **encoding, size_t *len, const bpe_train_opts_t *opts,
+                            bpe_train_stats_t *stats);
+
+// token streams on disk, tokens must be below vocab_size. with remap the ids are renumbered by how often they
+// occur and the table mapping them back is stored in front, so the common tokens get the short varints and a
+// fixed width only has to cover the tokens that occur. bytes_written may be NULL
+bool bpe_tokens_write(const char *path, const uint32_t *tokens, size_t len, size_t vocab_size, bpe_pack_mode_t mode, bool remap,
+                      size_t *bytes_written);
+bool bpe_tokens_read(const char *path, uint32_t **tokens, size_t *len);
+
+// static rans over token ids with a 64 bit state. the token frequencies, scaled to a power of two, are stored
+// in front of the coded words, so a stream decodes on its own
+bool bpe_rans_encode(const uint32_t *tokens, size_t len, size_t vocab_size, uint8_t **out, size_t *out_len);
+bool bpe_rans_decode(const uint8_t *buf, size_t buf_len, uint32_t **tokens, size_t *len);
+
+// a merge table and its rans coded token stream in one file, what read gives back goes straight into decompress
+bool bpe_archive_write(const char *path, dyn_arr_t *pair_arr, const uint32_t *tokens, size_t len, size_t *bytes_written);
+bool bpe_archive_read(const char *path, dyn_arr_t **pair_arr, uint32_t **tokens, size_t *len);
+
+bool bpe_vocab_stats_record_merge(bpe_vocab_stats_t *stats, uint32_t token, uint32_t freq);
+// counts tokens into token_freq, e.g. to redo the counts for an encoding of another corpus
+bool bpe_vocab_stats_count_tokens(bpe_vocab_stats_t *stats, size_t num_of_tokens, const uint32_t *tokens, size_t len);
+void bpe_vocab_stats_free(bpe_vocab_stats_t *stats);
+// copies the frequencies into the model and prices every token, stats must cover the model's tokens
+bool bpe_model_attach_stats(bpe_model_t *model, const bpe_vocab_stats_t *stats);
+
+// drops the tokens that occur fewer than min_freq times in the encoding stats was counted over and that no
+// kept token is built from, then renumbers the kept ones densely in their old order. *old_to_new maps every
+// old id to its new one, UINT32_MAX for dropped tokens
+bool bpe_prune(dyn_arr_t *pair_arr, const bpe_vocab_stats_t *stats, size_t min_freq, dyn_arr_t **pruned, uint32_t **old_to_new);
+// rewrites an encoding made with pair_arr into one for the pruned table, dropped tokens split into kept parts
+bool bpe_prune_rewrite(dyn_arr_t *pair_arr, const uint32_t *old_to_new, const uint32_t *tokens, size_t len, uint32_t **out,
+                       size_t *out_len);
+
+// streams the merge graph to out (open_memstream or fmemopen give a buffer), nodes carry their depth and
+// fan-in. without include_bytes the byte tokens get no node entries of their own, the edges to them stay. either
+// out or stats may be NULL
+bool bpe_graph_export(dyn_arr_t *pair_arr, FILE *out, bpe_graph_format_t format, bool include_bytes, bpe_graph_stats_t *stats);
+
+// writes tokens first_token and up in one pass over the model's token bytes. json strings escape bytes
+// above 0x7f as \u0080 to \u00ff, and frequencies are included when stats were attached to the model
+bool bpe_vocab_export(const bpe_model_t *model, FILE *out, bpe_vocab_format_t format, size_t first_token);
+
+bpe_model_t *bpe_model_create(dyn_arr_t *pair_arr);
+void bpe_model_free(bpe_model_t *model);
+// exact number of bytes the token sequence decodes to, or SIZE_MAX if it contains an unknown token
+size_t bpe_decoded_size(const bpe_model_t *model, const uint32_t *tokens, size_t len);
+// decodes into dst without allocating; returns the number of bytes written, or SIZE_MAX if a token
+// is unknown or the output does not fit in cap (nothing is written in that case)
+size_t bpe_decode_into(const bpe_model_t *model, const uint32_t *tokens, size_t len, uint8_t *dst, size_t cap);
+// fills iov with slices pointing into model->token_bytes (valid while the model lives), merging slices
+// that are adjacent in the arena; returns the number of entries used and stores how many tokens were
+// covered in *consumed, so callers can loop when iov_cap is smaller than needed. SIZE_MAX on unknown token
+size_t bpe_decode_iov(const bpe_model_t *model, const uint32_t *tokens, size_t len, struct iovec *iov, size_t iov_cap, size_t *consumed);
+// applies the model's merges to raw bytes, producing the same symbols training would have
+bool bpe_encode(const bpe_model_t *model, const uint8_t *bytes, size_t len, uint32_t **encoding, size_t *encoding_len);
 
 #endif
\ No newline at end of file
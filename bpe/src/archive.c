@@ -0,0 +1,112 @@
+#include "../inc/bpe.h"
+
+#define ARCHIVE_MAGIC "BPEARCH1"
+#define ARCHIVE_VERSION 1
+
+// on disk layout: this header, num_of_merges pair_t records (the merges after the 256 byte tokens), then
+// coded_len bytes of bpe_rans_encode output, all in host byte order like the checkpoints
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t num_of_merges;
+    uint64_t coded_len;
+} archive_header_t;
+
+bool bpe_archive_write(const char *path, dyn_arr_t *pair_arr, const uint32_t *tokens, size_t len, size_t *bytes_written)
+{
+    if (!path || !pair_arr || pair_arr->last_index < 255 || !pair_arr->contiguous || (!tokens && len))
+        return false;
+
+    uint8_t *coded;
+    size_t coded_len;
+    if (!bpe_rans_encode(tokens, len, pair_arr->last_index + 1, &coded, &coded_len))
+        return false;
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        perror("fopen");
+        free(coded);
+        return false;
+    }
+
+    archive_header_t header = {
+        .version = ARCHIVE_VERSION,
+        .num_of_merges = pair_arr->last_index - 255,
+        .coded_len = coded_len,
+    };
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+
+    const pair_t *merges = pair_vec_at(pair_arr, 256);
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(merges, sizeof(pair_t), header.num_of_merges, file) == header.num_of_merges &&
+              fwrite(coded, 1, coded_len, file) == coded_len;
+    if (fclose(file))
+        ok = false;
+
+    if (ok && bytes_written)
+        *bytes_written = sizeof(header) + header.num_of_merges * sizeof(pair_t) + coded_len;
+
+    free(coded);
+    return ok;
+}
+
+bool bpe_archive_read(const char *path, dyn_arr_t **pair_arr, uint32_t **tokens, size_t *len)
+{
+    if (!path || !pair_arr || !tokens || !len)
+        return false;
+
+    *tokens = NULL;
+    *len = 0;
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        perror("fopen");
+        return false;
+    }
+
+    archive_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)) ||
+        header.version != ARCHIVE_VERSION || header.num_of_merges > UINT32_MAX - 256 || header.coded_len > SIZE_MAX)
+    {
+        fprintf(stderr, "%s is not an archive\n", path);
+        fclose(file);
+        return false;
+    }
+
+    *pair_arr = dyn_arr_create_contiguous(256 + header.num_of_merges, sizeof(pair_t));
+    uint8_t *coded = (uint8_t *)malloc(header.coded_len ? header.coded_len : 1);
+    bool ok = *pair_arr && coded;
+
+    for (uint32_t i = 0; ok && i < 256; i++)
+        ok = pair_vec_set(*pair_arr, i, (pair_t){i, 0});
+
+    // a merge can only refer to tokens made before it
+    for (size_t i = 256; ok && i < 256 + header.num_of_merges; i++)
+    {
+        pair_t pair;
+        ok = fread(&pair, sizeof(pair_t), 1, file) == 1 && pair.a < i && pair.b < i && pair_vec_set(*pair_arr, i, pair);
+    }
+
+    ok = ok && fread(coded, 1, header.coded_len, file) == header.coded_len;
+    fclose(file);
+
+    ok = ok && bpe_rans_decode(coded, header.coded_len, tokens, len);
+    for (size_t i = 0; ok && i < *len; i++)
+        ok = (*tokens)[i] < 256 + header.num_of_merges;
+
+    free(coded);
+    if (!ok)
+    {
+        fprintf(stderr, "%s is truncated or corrupt\n", path);
+        free(*tokens);
+        dyn_arr_free(*pair_arr);
+        *pair_arr = NULL;
+        *tokens = NULL;
+        return false;
+    }
+
+    return true;
+}
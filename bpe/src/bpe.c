@@ -93,38 +93,14 @@ char *resolve_pair(uint32_t pair_index, dyn_arr_t *pair_arr, hash_table_t *memoi
 
 void render_pairs(dyn_arr_t *pair_arr)
 {
-    hash_table_t *mem_table = create_mem_table();
-    if (!mem_table)
+    bpe_model_t *model = bpe_model_create(pair_arr);
+    if (!model)
     {
         return;
     }
 
-    for (size_t index = 256; index <= pair_arr->last_index; index++)
-    {
-        pair_t pair;
-        if (!dyn_arr_get(pair_arr, index, (void *)&pair))
-        {
-            return;
-        }
-
-        if (pair.a == index)
-        {
-            fprintf(stdout, "%zu => %c\n", index, (char)pair.a);
-        }
-        else
-        {
-            char *str = resolve_pair(index, pair_arr, mem_table);
-            if (!str)
-            {
-                return;
-            }
-
-            fprintf(stdout, "%zu => %s\n", index, str);
-            free(str);
-        }
-    }
-
-    hash_table_destroy(mem_table);
+    bpe_vocab_export(model, stdout, BPE_VOCAB_TEXT, 256);
+    bpe_model_free(model);
 }
 
 char *get_file(const char *path)
@@ -195,49 +171,22 @@ void print_text(const uint32_t *text, int length)
     printf("\n");
 }
 
-void print_graph(dyn_arr_t *pair_arr, const char *png_name, bool add_ascii)
+bool print_graph(dyn_arr_t *pair_arr, const char *dot_path, bool add_ascii)
 {
-    FILE *temp_file = fopen("temp_graph.dot", "w");
-    if (!temp_file)
-    {
-        perror("Failed to create temp file");
-        return;
-    }
-
-    fprintf(temp_file, "digraph Pairs {\n");
-    if (add_ascii)
-    {
-        for (uint32_t index = 0; index < pair_arr->last_index; index++)
-        {
-            pair_t pair;
-            dyn_arr_get(pair_arr, index, (void *)&pair);
-            fprintf(temp_file, "%u -> %u;\n", index, pair.a);
-            fprintf(temp_file, "%u -> %u;\n", index, pair.b);
-        }
-    }
-    else
+    FILE *file = fopen(dot_path, "w");
+    if (!file)
     {
-        for (uint32_t index = 256; index < pair_arr->last_index; index++)
-        {
-            pair_t pair;
-            dyn_arr_get(pair_arr, index, (void *)&pair);
-            fprintf(temp_file, "%u -> %u;\n", index, pair.a);
-            fprintf(temp_file, "%u -> %u;\n", index, pair.b);
-        }
+        perror("fopen");
+        return false;
     }
 
-    fprintf(temp_file, "}\n");
-    fclose(temp_file);
-
-    char command[256];
-    snprintf(command, sizeof(command), "dot -Tpng temp_graph.dot -o %s", png_name);
-    int result = system(command);
-    if (result != 0)
-    {
-        fprintf(stderr, "Failed to generate PNG\n");
-    }
+    bool ok = bpe_graph_export(pair_arr, file, BPE_GRAPH_DOT, add_ascii, NULL);
+    if (fclose(file))
+        ok = false;
 
-    int rv = system("rm temp_graph.dot");
+    if (!ok)
+        fprintf(stderr, "Failed to write %s\n", dot_path);
+    return ok;
 }
 
 bool dump_pairs(const char *path, dyn_arr_t *pair_arr)
@@ -255,12 +204,12 @@ bool dump_pairs(const char *path, dyn_arr_t *pair_arr)
         return false;
     }
 
-    for (uint16_t index = 256; index < pair_arr->last_index; index++)
+    for (size_t index = 256; index <= pair_arr->last_index; index++)
     {
         pair_t pair;
         if (!dyn_arr_get(pair_arr, index, &pair))
         {
-            fprintf(stderr, "Error retrieving element at index %u\n", index);
+            fprintf(stderr, "Error retrieving element at index %zu\n", index);
             fclose(dump);
             return false;
         }
@@ -292,7 +241,7 @@ dyn_arr_t *read_pairs(const char *path)
         return NULL;
     }
 
-    dyn_arr_t *pair_arr = dyn_arr_create(512, sizeof(pair_t));
+    dyn_arr_t *pair_arr = dyn_arr_create_contiguous(512, sizeof(pair_t));
     if (!pair_arr)
     {
         fprintf(stderr, "Failed to create dynamic array\n");
@@ -340,57 +289,32 @@ dyn_arr_t *read_pairs(const char *path)
 
 char *decompress(uint32_t *encoding, size_t len, dyn_arr_t *pair_arr)
 {
-#define INIT_LEN (4096)
-    hash_table_t *mem_table = create_mem_table();
-    if (!mem_table)
+    bpe_model_t *model = bpe_model_create(pair_arr);
+    if (!model)
     {
         return NULL;
     }
 
-    char *str = (char *)malloc(sizeof(char) * INIT_LEN);
-    if (!str)
+    // size the output exactly up front instead of growing it token by token
+    size_t str_len = bpe_decoded_size(model, encoding, len);
+    if (str_len == SIZE_MAX)
     {
+        bpe_model_free(model);
         return NULL;
     }
 
-    size_t str_pos = 0;
-    size_t str_capacity = INIT_LEN;
-    str[0] = 0; // initialize as empty string
-
-    for (size_t index = 0; index < len; index++)
+    char *str = (char *)malloc(str_len + 1); // +1 for null terminator
+    if (!str)
     {
-        char *res_pair = resolve_pair(encoding[index], pair_arr, mem_table);
-        if (!res_pair)
-        {
-            free(str);
-            return NULL;
-        }
-
-        size_t pair_len = strlen(res_pair);
-        if (str_pos + pair_len + 1 >= str_capacity) // +1 for null terminator
-        {
-            size_t new_capacity = 2 * (str_capacity + pair_len);
-            char *new_str = realloc(str, new_capacity);
-            if (!new_str)
-            {
-                free(res_pair);
-                free(str);
-                return NULL;
-            }
-            str = new_str;
-            str_capacity = new_capacity;
-        }
-
-        // copy the pair to the end of str
-        strcpy(str + str_pos, res_pair);
-        str_pos += pair_len;
-
-        free(res_pair);
+        bpe_model_free(model);
+        return NULL;
     }
 
-    hash_table_destroy(mem_table);
+    size_t str_pos = bpe_decode_into(model, encoding, len, (uint8_t *)str, str_len);
+    str[str_pos] = 0;
+
+    bpe_model_free(model);
     return str;
-#undef INIT_LEN
 }
 
 #include <time.h>
@@ -405,17 +329,49 @@ char *decompress(uint32_t *encoding, size_t len, dyn_arr_t *pair_arr)
                          (end.tv_nsec - (beg).tv_nsec) / 1e9;   \
         fprintf(stdout, "%s: %lf seconds\n", (label), elapsed); \
     } while (0)
+#define PROFILE_ACCUM_TS(beg, acc)                            \
+    do                                                        \
+    {                                                         \
+        struct timespec end;                                  \
+        clock_gettime(CLOCK_MONOTONIC, &end);                 \
+        (acc) += (end.tv_sec - (beg).tv_sec) +                \
+                 (end.tv_nsec - (beg).tv_nsec) / 1e9;         \
+    } while (0)
+
+// hot path counters inside the workers, compiled out unless built with -DBPE_INSTRUMENT
+#ifdef BPE_INSTRUMENT
+#define INSTRUMENT_BEGIN_TS(beg) PROFILE_BEGIN_TS(beg)
+#define INSTRUMENT_ACCUM_TS(beg, acc) PROFILE_ACCUM_TS(beg, acc)
+#define INSTRUMENT_ADD(counter, n) ((counter) += (n))
+#else
+#define INSTRUMENT_BEGIN_TS(beg) ((void)0)
+#define INSTRUMENT_ACCUM_TS(beg, acc) ((void)0)
+#define INSTRUMENT_ADD(counter, n) ((void)0)
+#endif
 
 #define THREAD_NO 16
+#define MAX_THREAD_NO BPE_MAX_THREAD_NO
 
 static uint32_t *text;
 static uint32_t *temp;
 static size_t text_size;
-static hash_table_t *thread_tables[THREAD_NO];
-static pthread_t worker_threads[THREAD_NO] = {0};
+static size_t thread_no = THREAD_NO;
+static hash_table_t *thread_tables[MAX_THREAD_NO];
+static sharded_hash_table_t *shared_table; // set instead of thread_tables with BPE_COUNT_SHARED
+static pair_store_t *thread_stores[MAX_THREAD_NO]; // set instead of thread_tables with BPE_COUNT_DENSE
+static pthread_t worker_threads[MAX_THREAD_NO] = {0};
+
+// each worker writes only its own slot, padded so the slots don't share a cache line
+typedef struct
+{
+    double count_time;
+    double wait_time;
+    size_t pairs;
+} __attribute__((aligned(64))) worker_stats_t;
+
+static worker_stats_t worker_stats[MAX_THREAD_NO];
 
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 static int terminate = 0;
 
 static pthread_barrier_t barrier;
@@ -425,9 +381,156 @@ static pthread_barrier_t barrier;
 static size_t next_chunk_index;
 static pthread_mutex_t chunk_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// what the workers do when the main thread releases them from the start barrier
+typedef enum
+{
+    WORKER_TASK_COUNT = 0, // count the pairs of text into the thread's table
+    WORKER_TASK_INGEST,    // widen the thread's slice of ingest_buffer into text and temp
+    WORKER_TASK_REPLACE,   // replace the round's merges in the thread's slice of text, compacted into temp at the slice start
+    WORKER_TASK_COMPACT,   // move the thread's replaced slice from temp to its final offset in text
+} worker_task_t;
+
+static worker_task_t worker_task;
+static const char *ingest_buffer;
+// with opts->numa every worker keeps to an even slice of the text so it reads the pages it first touched.
+// the compact pass moves every slice down by what the slices before it shrank, so that only stays true
+// while the text is close to its ingested length; the training loop clears it once the slices have drifted
+static bool static_partitions;
+static bpe_numa_plan_t numa_plan;
+static bool numa_pinning;
+
+// the slice of [0, size) worker thread_idx owns when the text is split evenly, the last one takes the rest
+static inline void static_partition(size_t thread_idx, size_t size, size_t *start, size_t *len)
+{
+    size_t per_thread_len = size / thread_no;
+    *start = thread_idx * per_thread_len;
+    *len = (thread_idx == thread_no - 1) ? (per_thread_len + size % thread_no) : per_thread_len;
+}
+
+bool val_add(const void *val_one, const void *val_two, const void *result)
+{
+    if (!val_one || !val_two || !result)
+        return false;
+
+    size_t size_one = *(size_t *)val_one;
+    size_t size_two = *(size_t *)val_two;
+
+    *(size_t *)result = size_one + size_two;
+    return true;
+}
+
+static inline void count_pair(size_t thread_idx, pair_t pair)
+{
+    const size_t one = 1;
+    if (thread_stores[thread_idx])
+        pair_store_add(thread_stores[thread_idx], pair, 1);
+    else if (shared_table)
+        sharded_hash_table_upsert(shared_table, &pair, &one, val_add);
+    else
+        hash_table_upsert(thread_tables[thread_idx], &pair, &one, val_add);
+}
+
+#define NO_BATCH_ENTRY UINT32_MAX
+// below this many symbols per worker the replacement stays on the main thread
+#define PARALLEL_REPLACE_MIN_LEN (16 * 1024)
+
+// the merges of the current round, read by whoever runs the replacement pass
+static const pair_freq_t *replace_batch;
+static size_t replace_batch_len;
+static const uint32_t *replace_lookup; // first symbol -> batch entry, NULL when the batch is a single pair
+static uint32_t replace_symbol;        // symbol the first batch entry merges into
+static size_t replace_len[MAX_THREAD_NO];    // symbols each worker's slice was replaced into
+static size_t replace_offset[MAX_THREAD_NO]; // where each slice goes in the new text, a prefix sum of replace_len
+static bool replace_count;                   // count the next round's pairs during the replacement pass
+
+// the batch entry the pair starting at i matches, ignoring whether i was already consumed
+static inline uint32_t batch_entry_at(size_t i)
+{
+    if (i + 1 >= text_size)
+        return NO_BATCH_ENTRY;
+
+    uint32_t j = replace_lookup ? replace_lookup[text[i]] : (text[i] == replace_batch[0].pair.a ? 0 : NO_BATCH_ENTRY);
+    return (j != NO_BATCH_ENTRY && text[i + 1] == replace_batch[j].pair.b) ? j : NO_BATCH_ENTRY;
+}
+
+// whether the left to right pass merges the pair starting at i. batch pairs share no symbols, so matches
+// of different pairs can't overlap and only a self pair (x, x) depends on what came before it: inside a run
+// of x it merges at even distances from the start of the run
+static bool merges_at(size_t i)
+{
+    uint32_t j = batch_entry_at(i);
+    if (j == NO_BATCH_ENTRY)
+        return false;
+
+    if (replace_batch[j].pair.a != replace_batch[j].pair.b)
+        return true;
+
+    size_t run_start = i;
+    while (run_start && text[run_start - 1] == text[i])
+        run_start--;
+
+    return !((i - run_start) % 2);
+}
+
+// input symbols replaced before the freshly written output is counted, small enough to still be in L1 by then
+#define REPLACE_COUNT_BLOCK 2048
+
+// writes text[start, end) with the round's merges applied to out and returns its length. a merge belongs to
+// the range its first symbol is in, so a range skips its first symbol when the previous range's last merge took it.
+// with count set the adjacent pairs of out are counted into thread_idx's table on the way, a block at a time, so
+// the next round doesn't have to read the whole text from memory again; pairs spanning two ranges are left to the caller
+static size_t replace_range(size_t start, size_t end, uint32_t *out, bool count, size_t thread_idx)
+{
+    size_t out_len = 0;
+    size_t counted = 0; // out[0, counted] has had all its pairs counted
+    size_t i = start;
+    if (start && start < end && merges_at(start - 1))
+        i++;
+
+    while (i < end)
+    {
+        size_t block_end = end - i > REPLACE_COUNT_BLOCK ? i + REPLACE_COUNT_BLOCK : end;
+        while (i < block_end)
+        {
+            uint32_t j = batch_entry_at(i);
+            if (j != NO_BATCH_ENTRY)
+            {
+                out[out_len++] = replace_symbol + j;
+                i += 2;
+            }
+            else
+            {
+                out[out_len++] = text[i++];
+            }
+        }
+
+        if (!count)
+            continue;
+
+#ifdef BPE_INSTRUMENT
+        struct timespec count_ts;
+#endif
+        INSTRUMENT_BEGIN_TS(count_ts);
+        INSTRUMENT_ADD(worker_stats[thread_idx].pairs, out_len - 1 - counted);
+        // counting in a loop of its own keeps both loops tight, interleaving the two per symbol is far slower
+        for (; counted + 1 < out_len; counted++)
+            count_pair(thread_idx, (pair_t){out[counted], out[counted + 1]});
+        INSTRUMENT_ACCUM_TS(count_ts, worker_stats[thread_idx].count_time);
+    }
+
+    return out_len;
+}
+
 static void *get_freq(void *arg)
 {
     size_t thread_idx = (size_t)arg;
+#ifdef BPE_INSTRUMENT
+    struct timespec count_ts, wait_ts;
+#endif
+    size_t pairs = 0;
+
+    if (numa_pinning)
+        bpe_numa_pin_self(numa_plan.worker_cpu[thread_idx]);
 
     while (true)
     {
@@ -442,15 +545,46 @@ static void *get_freq(void *arg)
         }
         pthread_mutex_unlock(&mutex);
 
+        if (worker_task == WORKER_TASK_INGEST)
+        {
+            // the first write to a page decides which node it lives on, so each worker writes the slice it will count
+            size_t start_index, chunk_len;
+            static_partition(thread_idx, text_size, &start_index, &chunk_len);
+            for (size_t i = start_index; i < start_index + chunk_len; i++)
+            {
+                text[i] = (uint32_t)(uint8_t)ingest_buffer[i];
+                temp[i] = text[i];
+            }
+
+            pthread_barrier_wait(&barrier);
+            continue;
+        }
+
+        if (worker_task == WORKER_TASK_REPLACE || worker_task == WORKER_TASK_COMPACT)
+        {
+            size_t start_index, chunk_len;
+            static_partition(thread_idx, text_size, &start_index, &chunk_len);
+            // the slice is never longer than its input, so replacing into temp at the slice start can't
+            // reach the next slice, and all of text has been read by the time the compact pass overwrites it
+            if (worker_task == WORKER_TASK_REPLACE)
+                replace_len[thread_idx] = replace_range(start_index, start_index + chunk_len, temp + start_index, replace_count, thread_idx);
+            else
+                memmove(text + replace_offset[thread_idx], temp + start_index, replace_len[thread_idx] * sizeof(uint32_t));
+
+            pthread_barrier_wait(&barrier);
+            continue;
+        }
+
+        INSTRUMENT_BEGIN_TS(count_ts);
+
         // adaptive chunk size based on text size and thread count
         size_t adaptive_chunk_size;
         pthread_mutex_lock(&chunk_mutex);
         // for small text sizes, revert to simple thread division
-        if (text_size < CHUNK_SIZE * THREAD_NO)
+        if (static_partitions || text_size < CHUNK_SIZE * thread_no)
         {
-            size_t per_thread_len = text_size / THREAD_NO;
-            size_t start_index = thread_idx * per_thread_len;
-            size_t chunk_len = (thread_idx == THREAD_NO - 1) ? (per_thread_len + text_size % THREAD_NO) : per_thread_len;
+            size_t start_index, chunk_len;
+            static_partition(thread_idx, text_size, &start_index, &chunk_len);
 
             // process this chunk only if it has data
             if (chunk_len > 0)
@@ -462,12 +596,8 @@ static void *get_freq(void *arg)
                     if (i + 1 >= text_size)
                         break;
 
-                    pair_t pair = {text[i], text[i + 1]};
-                    size_t count = 0;
-
-                    hash_table_search(thread_tables[thread_idx], &pair, &count);
-                    count++;
-                    hash_table_insert(thread_tables[thread_idx], &pair, &count);
+                    count_pair(thread_idx, (pair_t){text[i], text[i + 1]});
+                    INSTRUMENT_ADD(pairs, 1);
                 }
             }
             else
@@ -509,45 +639,191 @@ static void *get_freq(void *arg)
                     if (i + 1 >= text_size)
                         break;
 
-                    pair_t pair = {text[i], text[i + 1]};
-                    size_t count = 0;
-
-                    hash_table_search(thread_tables[thread_idx], &pair, &count);
-                    count++;
-                    hash_table_insert(thread_tables[thread_idx], &pair, &count);
+                    count_pair(thread_idx, (pair_t){text[i], text[i + 1]});
+                    INSTRUMENT_ADD(pairs, 1);
                 }
             }
         }
 
+        INSTRUMENT_ACCUM_TS(count_ts, worker_stats[thread_idx].count_time);
+        INSTRUMENT_ADD(worker_stats[thread_idx].pairs, pairs);
+        pairs = 0;
+        INSTRUMENT_BEGIN_TS(wait_ts);
+
         // signal to the main thread that this thread is completed
         pthread_barrier_wait(&barrier);
+
+        INSTRUMENT_ACCUM_TS(wait_ts, worker_stats[thread_idx].wait_time);
     }
 
+    (void)pairs;
     return (void *)1;
 }
 
-bool val_add(const void *val_one, const void *val_two, const void *result)
+dyn_arr_t *compress(const char *path, uint32_t **encoding, size_t *len)
 {
-    if (!val_one || !val_two || !result)
+    return compress_ex(path, encoding, len, NULL, NULL);
+}
+
+#define PER_THREAD_TABLE_BUCKET_NUM (1U << 8)
+#define MERGED_TABLE_BUCKET_NUM (1U << 16)
+// a count table's free list is only cut back once it holds this many times what a round used
+#define COUNT_TABLE_TRIM_RATIO 4
+// enough shards that two workers rarely want the same lock, together sized like the merged table
+#define SHARDS_PER_THREAD 16
+
+// scratch owned by one compress_ex() run, reset in place every round instead of reallocated,
+// so once the buffers have grown to the largest round a merge round makes no allocator calls
+typedef struct
+{
+    hash_table_t *merged_table; // the round's counts with BPE_COUNT_LOCAL_MERGE, cleared after every round
+    dyn_arr_t *node_arr;        // the round's counts flattened
+    pair_freq_t *batch;         // merges_per_round entries
+    pair_freq_t *cands;         // BPE_BATCH_CANDIDATE_FACTOR * merges_per_round entries, for bpe_select_batch
+    uint32_t *symbol_info;      // 3 * symbol_cap entries, for bpe_select_batch
+    uint32_t *batch_lookup;     // symbol_cap entries, for the batched replacement
+    size_t symbol_cap;
+} train_ctx_t;
+
+static bool train_ctx_init(train_ctx_t *ctx, size_t merges_per_round, size_t symbol_cap, bool merged_table)
+{
+    memset(ctx, 0, sizeof(train_ctx_t));
+    ctx->symbol_cap = symbol_cap;
+    ctx->node_arr = dyn_arr_create_contiguous(MAX_NODE_SIZE, sizeof(pair_freq_t));
+    ctx->batch = (pair_freq_t *)malloc(merges_per_round * sizeof(pair_freq_t));
+    if (!ctx->node_arr || !ctx->batch)
         return false;
 
-    size_t size_one = *(size_t *)val_one;
-    size_t size_two = *(size_t *)val_two;
+    if (merged_table && !(ctx->merged_table = hash_table_create(MERGED_TABLE_BUCKET_NUM, sizeof(pair_t), sizeof(size_t))))
+        return false;
+
+    // the bpe_select_batch and batched replacement scratch is only needed when merging more than one pair a round
+    if (merges_per_round > 1)
+    {
+        ctx->cands = (pair_freq_t *)malloc(merges_per_round * BPE_BATCH_CANDIDATE_FACTOR * sizeof(pair_freq_t));
+        ctx->symbol_info = (uint32_t *)malloc(3 * symbol_cap * sizeof(uint32_t));
+        ctx->batch_lookup = (uint32_t *)malloc(symbol_cap * sizeof(uint32_t));
+        if (!ctx->cands || !ctx->symbol_info || !ctx->batch_lookup)
+            return false;
+    }
 
-    *(size_t *)result = size_one + size_two;
     return true;
 }
 
-dyn_arr_t *compress(const char *path, uint32_t **encoding, size_t *len)
+// makes the per symbol scratch cover symbol_limit symbols, doubling so unbounded training reallocates rarely
+static bool train_ctx_reserve_symbols(train_ctx_t *ctx, size_t symbol_limit)
+{
+    if (symbol_limit <= ctx->symbol_cap)
+        return true;
+
+    size_t symbol_cap = ctx->symbol_cap * 2 > symbol_limit ? ctx->symbol_cap * 2 : symbol_limit;
+    uint32_t *symbol_info = (uint32_t *)realloc(ctx->symbol_info, 3 * symbol_cap * sizeof(uint32_t));
+    if (!symbol_info)
+        return false;
+    ctx->symbol_info = symbol_info;
+
+    uint32_t *batch_lookup = (uint32_t *)realloc(ctx->batch_lookup, symbol_cap * sizeof(uint32_t));
+    if (!batch_lookup)
+        return false;
+    ctx->batch_lookup = batch_lookup;
+
+    ctx->symbol_cap = symbol_cap;
+    return true;
+}
+
+static void train_ctx_free(train_ctx_t *ctx)
+{
+    hash_table_destroy(ctx->merged_table);
+    if (ctx->node_arr)
+        dyn_arr_free(ctx->node_arr);
+    free(ctx->batch);
+    free(ctx->cands);
+    free(ctx->symbol_info);
+    free(ctx->batch_lookup);
+    memset(ctx, 0, sizeof(train_ctx_t));
+}
+
+// clears a count table, its nodes stay on the free list for the next round. *held tracks the nodes the table
+// owns; they are handed back only once far more than a round needs, and then down to twice its use, so the
+// slowly shrinking rounds of a run reuse nodes without calling the allocator
+static void recycle_count_table(hash_table_t *table, size_t *held)
+{
+    size_t used = table->num_of_nodes;
+    hash_table_clear(table);
+    *held = used > *held ? used : *held;
+    if (*held > COUNT_TABLE_TRIM_RATIO * used)
+    {
+        hash_table_trim(table, 2 * used);
+        *held = 2 * used;
+    }
+}
+
+dyn_arr_t *compress_ex(const char *path, uint32_t **encoding, size_t *len, const bpe_train_opts_t *opts, bpe_train_stats_t *stats)
 {
     pthread_attr_t attr;
     dyn_arr_t *pair_arr = NULL;
-    hash_table_t *table = NULL;
     bool threads_created = false;
+    bpe_train_stats_t run_stats = {0};
+    struct timespec total_ts, phase_ts;
 
     if (!path || !encoding || !len)
         return NULL;
 
+    thread_no = THREAD_NO;
+    size_t max_merges = 0;
+    bpe_progress_cb progress = NULL;
+    size_t progress_every = 1;
+    size_t merges_per_round = 1;
+    double batch_min_ratio = 0;
+    bpe_count_mode_t count_mode = BPE_COUNT_LOCAL_MERGE;
+    bool numa = false;
+    bool fused_count = true;
+    const char *checkpoint_path = NULL;
+    size_t checkpoint_every = 0;
+    bool resume = false;
+    bpe_checkpointer_t *checkpointer = NULL;
+    // nodes each count table owns, live or on its free list, see recycle_count_table
+    size_t thread_table_nodes[MAX_THREAD_NO] = {0};
+    size_t merged_table_nodes = 0;
+    uint64_t corpus_hash = 0;
+    dyn_arr_t *base_pairs = NULL;
+    bpe_vocab_stats_t *vocab_stats = NULL;
+    train_ctx_t ctx = {0};
+    if (opts)
+    {
+        thread_no = (opts->thread_no && opts->thread_no <= MAX_THREAD_NO) ? opts->thread_no : MAX_THREAD_NO;
+        max_merges = opts->max_merges;
+        progress = opts->progress;
+        progress_every = opts->progress_every ? opts->progress_every : 1;
+        merges_per_round = opts->merges_per_round ? opts->merges_per_round : 1;
+        batch_min_ratio = opts->batch_min_ratio;
+        count_mode = opts->count_mode;
+        numa = opts->numa;
+        fused_count = !opts->separate_count;
+        checkpoint_path = opts->checkpoint_path;
+        checkpoint_every = opts->checkpoint_every;
+        resume = opts->resume;
+        base_pairs = opts->base_pairs;
+        vocab_stats = opts->vocab_stats;
+    }
+
+    if (vocab_stats)
+        memset(vocab_stats, 0, sizeof(bpe_vocab_stats_t));
+
+    worker_task = WORKER_TASK_COUNT;
+    static_partitions = numa;
+    numa_pinning = false;
+    if (numa && bpe_numa_plan(thread_no, &numa_plan))
+    {
+        numa_pinning = numa_plan.worker_cpu[0] >= 0;
+        run_stats.numa_nodes = numa_plan.num_of_nodes;
+    }
+
+    memset(worker_stats, 0, sizeof(worker_stats));
+
+    PROFILE_BEGIN_TS(total_ts);
+    PROFILE_BEGIN_TS(phase_ts);
+
     char *text_buffer = get_file(path);
     if (!text_buffer)
         return NULL;
@@ -562,6 +838,9 @@ dyn_arr_t *compress(const char *path, uint32_t **encoding, size_t *len)
         return NULL;
     }
 
+    if (checkpoint_path)
+        corpus_hash = bpe_corpus_hash((const uint8_t *)text_buffer, original_text_size);
+
     text = (uint32_t *)malloc(text_size * sizeof(uint32_t));
     if (!text)
     {
@@ -577,19 +856,27 @@ dyn_arr_t *compress(const char *path, uint32_t **encoding, size_t *len)
         return NULL;
     }
 
-    for (size_t i = 0; i < text_size; i++)
+    // with numa the workers widen the text themselves once they are pinned, see WORKER_TASK_INGEST
+    // and with base merges the encoder reads the bytes directly
+    if (!numa && !base_pairs)
     {
-        text[i] = (uint32_t)(uint8_t)text_buffer[i];
-        temp[i] = (uint32_t)(uint8_t)text_buffer[i];
-    }
+        for (size_t i = 0; i < text_size; i++)
+        {
+            text[i] = (uint32_t)(uint8_t)text_buffer[i];
+            temp[i] = (uint32_t)(uint8_t)text_buffer[i];
+        }
 
-    free(text_buffer);
+        free(text_buffer);
+        text_buffer = NULL;
+    }
+    PROFILE_ACCUM_TS(phase_ts, run_stats.ingest_time);
 
     uint32_t next_symbol = 256;
-    pair_arr = dyn_arr_create(512, sizeof(pair_t));
+    pair_arr = dyn_arr_create_contiguous(512, sizeof(pair_t));
 
     if (!pair_arr)
     {
+        free(text_buffer);
         free(text);
         free(temp);
         return NULL;
@@ -601,52 +888,158 @@ dyn_arr_t *compress(const char *path, uint32_t **encoding, size_t *len)
         if (!dyn_arr_set(pair_arr, i, &pair))
         {
             dyn_arr_free(pair_arr);
+            free(text_buffer);
             free(text);
             free(temp);
             return NULL;
         }
     }
 
-#define PER_THREAD_TABLE_BUCKET_NUM (1U << 8)
-#define MERGED_TABLE_BUCKET_NUM (1U << 16)
+    pair_t *saved_merges;
+    uint32_t *saved_text;
+    size_t saved_merge_num, saved_text_size;
+    if (checkpoint_path && resume &&
+        bpe_checkpoint_read(checkpoint_path, original_text_size, corpus_hash, &saved_merges, &saved_merge_num, &saved_text, &saved_text_size))
+    {
+        for (size_t i = 0; i < saved_merge_num; i++)
+        {
+            if (saved_merges[i].a >= next_symbol + i || saved_merges[i].b >= next_symbol + i ||
+                !pair_vec_set(pair_arr, next_symbol + i, saved_merges[i]))
+            {
+                fprintf(stderr, "Invalid merge in checkpoint %s\n", checkpoint_path);
+                free(saved_merges);
+                free(saved_text);
+                goto error_handling;
+            }
+        }
 
-    for (size_t i = 0; i < THREAD_NO; i++)
+        // the per symbol scratch is sized by next_symbol, so a symbol past the saved merges must not get through
+        for (size_t i = 0; i < saved_text_size; i++)
+        {
+            if (saved_text[i] >= next_symbol + saved_merge_num)
+            {
+                fprintf(stderr, "Invalid symbol in checkpoint %s\n", checkpoint_path);
+                free(saved_merges);
+                free(saved_text);
+                goto error_handling;
+            }
+        }
+
+        // the text is picked up as it was after the last saved merge, so none of the ingest is needed
+        memcpy(text, saved_text, saved_text_size * sizeof(uint32_t));
+        text_size = saved_text_size;
+        next_symbol += saved_merge_num;
+        run_stats.resumed_merges = saved_merge_num;
+
+        free(saved_merges);
+        free(saved_text);
+        free(text_buffer);
+        text_buffer = NULL;
+    }
+    else if (base_pairs)
     {
-        thread_tables[i] = hash_table_create(PER_THREAD_TABLE_BUCKET_NUM, sizeof(pair_t), sizeof(size_t));
-        if (!thread_tables[i])
+        // the base merges are applied in one encoder pass rather than replayed round by round
+        bpe_model_t *base_model = bpe_model_create(base_pairs);
+        uint32_t *base_text;
+        size_t base_text_size;
+        if (!base_model || !bpe_encode(base_model, (const uint8_t *)text_buffer, original_text_size, &base_text, &base_text_size))
         {
-            for (size_t j = 0; j < i; j++)
-                hash_table_destroy(thread_tables[j]);
+            fprintf(stderr, "Could not encode the corpus with the base merges\n");
+            bpe_model_free(base_model);
+            goto error_handling;
+        }
+
+        // base_pairs may come from dyn_arr_create as well, bpe_model_create has already checked every merge
+        for (size_t index = 256; index < base_model->num_of_tokens; index++)
+        {
+            pair_t pair;
+            if (!dyn_arr_get(base_pairs, index, &pair) || !pair_vec_set(pair_arr, index, pair))
+            {
+                bpe_model_free(base_model);
+                free(base_text);
+                goto error_handling;
+            }
+        }
+
+        memcpy(text, base_text, base_text_size * sizeof(uint32_t));
+        text_size = base_text_size;
+        next_symbol = (uint32_t)base_model->num_of_tokens;
+        run_stats.base_merges = base_model->num_of_tokens - 256;
+
+        bpe_model_free(base_model);
+        free(base_text);
+        free(text_buffer);
+        text_buffer = NULL;
+    }
+
+    if (checkpoint_path && checkpoint_every && !(checkpointer = bpe_checkpointer_start(checkpoint_path)))
+    {
+        goto error_handling;
+    }
+    size_t last_checkpoint = next_symbol - 256;
 
+    // per symbol scratch sized for the whole run up front when the merge count is known
+    if (!train_ctx_init(&ctx, merges_per_round, max_merges ? 256 + max_merges : 2 * MAX_NODE_SIZE, count_mode == BPE_COUNT_LOCAL_MERGE))
+    {
+        goto error_handling;
+    }
+
+    if (count_mode == BPE_COUNT_SHARED)
+    {
+        size_t shard_num = thread_no * SHARDS_PER_THREAD;
+        shared_table = sharded_hash_table_create(shard_num, MERGED_TABLE_BUCKET_NUM / shard_num, sizeof(pair_t), sizeof(size_t));
+        if (!shared_table)
+        {
             goto error_handling;
         }
     }
+    else if (count_mode == BPE_COUNT_DENSE)
+    {
+        for (size_t i = 0; i < thread_no; i++)
+        {
+            thread_stores[i] = pair_store_create(512);
+            if (!thread_stores[i])
+            {
+                goto error_handling;
+            }
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < thread_no; i++)
+        {
+            thread_tables[i] = hash_table_create(PER_THREAD_TABLE_BUCKET_NUM, sizeof(pair_t), sizeof(size_t));
+            if (!thread_tables[i])
+            {
+                goto error_handling;
+            }
+        }
+    }
 
-    if (pthread_barrier_init(&barrier, NULL, THREAD_NO + 1))
+    if (pthread_barrier_init(&barrier, NULL, thread_no + 1))
     {
-        for (size_t i = 0; i < THREAD_NO; i++)
-            hash_table_destroy(thread_tables[i]);
         goto error_handling;
     }
 
     if (pthread_attr_init(&attr))
     {
-        dyn_arr_free(pair_arr);
-        free(text);
-        free(temp);
-        return NULL;
+        pthread_barrier_destroy(&barrier);
+        goto error_handling;
     }
 
     if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE))
     {
         pthread_attr_destroy(&attr);
-        dyn_arr_free(pair_arr);
-        free(text);
-        free(temp);
-        return NULL;
+        pthread_barrier_destroy(&barrier);
+        goto error_handling;
     }
 
-    for (size_t i = 0; i < THREAD_NO; i++)
+    // a previous run leaves this set once its workers have exited
+    pthread_mutex_lock(&mutex);
+    terminate = 0;
+    pthread_mutex_unlock(&mutex);
+
+    for (size_t i = 0; i < thread_no; i++)
     {
         if (pthread_create(&worker_threads[i], &attr, get_freq, (void *)i))
         {
@@ -656,136 +1049,368 @@ dyn_arr_t *compress(const char *path, uint32_t **encoding, size_t *len)
                 pthread_cancel(worker_threads[j]);
                 pthread_join(worker_threads[j], NULL);
             }
-            dyn_arr_free(pair_arr);
-            free(text);
-            free(temp);
-            return NULL;
+            pthread_barrier_destroy(&barrier);
+            goto error_handling;
         }
     }
 
     threads_created = true;
     pthread_attr_destroy(&attr);
 
-    for (size_t iteration = 0;; iteration++)
+    if (text_buffer)
     {
-        pthread_mutex_lock(&chunk_mutex);
-        next_chunk_index = 0; // reset the chunk index at the start of each iteration
-        pthread_mutex_unlock(&chunk_mutex);
-
-        // signal the threads to start this iteration
-        // this is a signal since all the other threads would be waiting on their first barrier for the main thread
-        // to cross the barrier and let them run
+        PROFILE_BEGIN_TS(phase_ts);
+        ingest_buffer = text_buffer;
+        worker_task = WORKER_TASK_INGEST;
         pthread_barrier_wait(&barrier);
-
-        // the main thread will wait on this barrier until all the others have completed, signalling main to
-        // continue it's execution
         pthread_barrier_wait(&barrier);
+        worker_task = WORKER_TASK_COUNT;
+        ingest_buffer = NULL;
 
-        table = hash_table_merge(thread_tables, THREAD_NO, val_add,
-                                 sizeof(pair_t), sizeof(size_t), MERGED_TABLE_BUCKET_NUM);
+        free(text_buffer);
+        text_buffer = NULL;
+        PROFILE_ACCUM_TS(phase_ts, run_stats.ingest_time);
+    }
 
-        if (!table)
+    // set once a replacement pass has already counted the pairs of the text it wrote
+    bool counts_ready = false;
+    for (size_t iteration = 0; !max_merges || next_symbol - 256 < max_merges; iteration++)
+    {
+        if (counts_ready)
         {
-            for (size_t i = 0; i < THREAD_NO; i++)
-                hash_table_destroy(thread_tables[i]);
+            run_stats.fused_rounds++;
+        }
+        else
+        {
+            // the last slice has moved down by about what the whole text shrank. past half a slice most of
+            // what each worker reads was first touched by another one, so dynamic chunks balance the count better
+            if (static_partitions && (original_text_size - text_size) * 2 * thread_no > original_text_size)
+                static_partitions = false;
 
-            goto error_handling;
+            pthread_mutex_lock(&chunk_mutex);
+            next_chunk_index = 0; // reset the chunk index at the start of each iteration
+            pthread_mutex_unlock(&chunk_mutex);
+
+            PROFILE_BEGIN_TS(phase_ts);
+
+            // signal the threads to start this iteration
+            // this is a signal since all the other threads would be waiting on their first barrier for the main thread
+            // to cross the barrier and let them run
+            pthread_barrier_wait(&barrier);
+
+            // the main thread will wait on this barrier until all the others have completed, signalling main to
+            // continue it's execution
+            pthread_barrier_wait(&barrier);
+
+            PROFILE_ACCUM_TS(phase_ts, run_stats.count_time);
         }
 
-        for (size_t i = 0; i < THREAD_NO; i++)
-            hash_table_clear(thread_tables[i]);
+        PROFILE_BEGIN_TS(phase_ts);
+        run_stats.iterations++;
+
+        // the tables holding this round's counts: the merged table, or every shard of the shared one
+        hash_table_t *count_tables[MAX_THREAD_NO * SHARDS_PER_THREAD];
+        size_t count_table_len = 0;
+        size_t pair_num = 0;
 
-        dyn_arr_t *node_arr = dyn_arr_create(0, sizeof(pair_freq_t));
-        if (!node_arr)
+        if (thread_stores[0])
         {
-            hash_table_destroy(table);
-            goto error_handling;
+            size_t bytes = 0;
+            for (size_t i = 1; i < thread_no; i++)
+            {
+                bytes += pair_store_bytes(thread_stores[i]);
+                if (!pair_store_merge(thread_stores[0], thread_stores[i]))
+                {
+                    goto error_handling;
+                }
+                pair_store_clear(thread_stores[i]);
+            }
+            pair_num = thread_stores[0]->num_of_pairs;
+
+            bytes += pair_store_bytes(thread_stores[0]);
+            if (bytes > run_stats.count_table_bytes)
+                run_stats.count_table_bytes = bytes;
         }
+        else if (shared_table)
+        {
+            for (size_t i = 0; i < shared_table->num_of_shards; i++)
+                count_tables[count_table_len++] = shared_table->shards[i].table;
+            pair_num = sharded_hash_table_size(shared_table);
 
-        size_t index = 0;
-        for (size_t i = 0; i < table->num_of_buckets; i++)
+            if (stats)
+            {
+                hash_table_stats_t shared_stats;
+                sharded_hash_table_stats(shared_table, &shared_stats);
+                if (shared_stats.bytes_allocated > run_stats.count_table_bytes)
+                    run_stats.count_table_bytes = shared_stats.bytes_allocated;
+#ifdef BPE_INSTRUMENT
+                if (shared_stats.num_of_nodes > run_stats.merged_table_stats.num_of_nodes)
+                    run_stats.merged_table_stats = shared_stats;
+#endif
+            }
+        }
+        else
         {
-            node_t *curr = table->buckets[i];
-            while (curr)
+            if (!hash_table_merge_into(ctx.merged_table, thread_tables, thread_no, val_add))
+            {
+                goto error_handling;
+            }
+
+            hash_table_t *table = ctx.merged_table;
+            count_tables[count_table_len++] = table;
+            pair_num = table->num_of_nodes;
+
+            if (stats)
+            {
+                hash_table_stats_t table_stats;
+                hash_table_stats(table, &table_stats);
+                size_t bytes = table_stats.bytes_allocated;
+                for (size_t i = 0; i < thread_no; i++)
+                {
+                    hash_table_stats(thread_tables[i], &table_stats);
+                    bytes += table_stats.bytes_allocated;
+                }
+                if (bytes > run_stats.count_table_bytes)
+                    run_stats.count_table_bytes = bytes;
+            }
+
+#ifdef BPE_INSTRUMENT
+            if (table->num_of_nodes > run_stats.merged_table_stats.num_of_nodes)
             {
-                pair_freq_t temp;
-                pair_t *pair = (pair_t *)curr->key;
-                size_t *freq = (size_t *)curr->value;
+                hash_table_stats(table, &run_stats.merged_table_stats);
+                for (size_t i = 0; i < thread_no; i++)
+                    hash_table_stats(thread_tables[i], &run_stats.thread_table_stats[i]);
+            }
+#endif
 
-                temp.pair.a = pair->a;
-                temp.pair.b = pair->b;
-                temp.freq = *freq;
+            for (size_t i = 0; i < thread_no; i++)
+                recycle_count_table(thread_tables[i], &thread_table_nodes[i]);
+        }
+
+        PROFILE_ACCUM_TS(phase_ts, run_stats.merge_time);
+        PROFILE_BEGIN_TS(phase_ts);
 
-                if (!dyn_arr_set(node_arr, index++, &temp))
+        dyn_arr_t *node_arr = ctx.node_arr;
+        if (!dyn_arr_reserve(node_arr, pair_num))
+        {
+            goto error_handling;
+        }
+
+        size_t index = 0;
+        if (thread_stores[0])
+        {
+            const pair_store_t *store = thread_stores[0];
+            for (size_t a = 0; a < store->num_of_rows; a++)
+            {
+                const pair_row_t *row = &store->rows[a];
+                for (size_t i = 0; row->len && i <= row->mask; i++)
                 {
-                    dyn_arr_free(node_arr);
-                    hash_table_destroy(table);
-                    goto error_handling;
+                    if (row->slots[i].b == PAIR_STORE_EMPTY)
+                        continue;
+
+                    pair_freq_t temp = {{(uint32_t)a, row->slots[i].b}, row->slots[i].value};
+                    if (!pair_freq_vec_set(node_arr, index++, temp))
+                    {
+                        goto error_handling;
+                    }
                 }
+            }
+            pair_store_clear(thread_stores[0]);
+        }
 
-                curr = curr->next;
+        for (size_t t = 0; t < count_table_len; t++)
+        {
+            hash_table_t *count_table = count_tables[t];
+            for (size_t i = 0; i < count_table->num_of_buckets; i++)
+            {
+                node_t *curr = count_table->buckets[i];
+                while (curr)
+                {
+                    pair_freq_t temp;
+                    pair_t *pair = (pair_t *)curr->key;
+                    size_t *freq = (size_t *)curr->value;
+
+                    temp.pair.a = pair->a;
+                    temp.pair.b = pair->b;
+                    temp.freq = *freq;
+
+                    if (!pair_freq_vec_set(node_arr, index++, temp))
+                    {
+                        goto error_handling;
+                    }
+
+                    curr = curr->next;
+                }
             }
         }
 
+        if (shared_table)
+            sharded_hash_table_clear(shared_table);
+
+        if (ctx.merged_table)
+            recycle_count_table(ctx.merged_table, &merged_table_nodes);
+
+        run_stats.distinct_pairs = index;
         if (!index)
         {
-            dyn_arr_free(node_arr);
-            hash_table_destroy(table);
+            PROFILE_ACCUM_TS(phase_ts, run_stats.select_time);
             break;
         }
 
-        pair_freq_t max;
-        if (!dyn_arr_max(node_arr, 0, index - 1, is_less, &max))
+        // typed scan over the contiguous block. ties go to the lowest pair like in bpe_select_batch, so the
+        // merges don't depend on the order the count tables happen to list the pairs in
+        pair_freq_t *nodes = pair_freq_vec_data(node_arr);
+        pair_freq_t max = nodes[0];
+        for (size_t i = 1; i < index; i++)
         {
-            dyn_arr_free(node_arr);
-            hash_table_destroy(table);
-            goto error_handling;
+            if (max.freq <= nodes[i].freq && pair_freq_less(&max, &nodes[i]))
+                max = nodes[i];
+        }
+
+        size_t round_limit = merges_per_round;
+        if (max_merges && max_merges - (next_symbol - 256) < round_limit)
+            round_limit = max_merges - (next_symbol - 256);
+
+        pair_freq_t *batch = ctx.batch;
+        size_t batch_len = 1;
+        batch[0] = max;
+        if (round_limit > 1 && max.freq > 1)
+        {
+            if (!train_ctx_reserve_symbols(&ctx, next_symbol))
+            {
+                goto error_handling;
+            }
+            bpe_select_batch(nodes, index, round_limit, batch_min_ratio, next_symbol, ctx.cands, ctx.symbol_info, batch, &batch_len);
         }
 
+        PROFILE_ACCUM_TS(phase_ts, run_stats.select_time);
+
         if (max.freq <= 1)
         {
-            dyn_arr_free(node_arr);
-            hash_table_destroy(table);
             break;
         }
 
-        pair_t new_pair = max.pair;
-        if (!dyn_arr_set(pair_arr, next_symbol, &new_pair))
+        for (size_t i = 0; i < batch_len; i++)
         {
-            dyn_arr_free(node_arr);
-            hash_table_destroy(table);
-            goto error_handling;
+            if (!pair_vec_set(pair_arr, next_symbol + i, batch[i].pair) ||
+                (vocab_stats && !bpe_vocab_stats_record_merge(vocab_stats, next_symbol + i, batch[i].freq)))
+            {
+                goto error_handling;
+            }
         }
 
-        size_t new_text_size = 0;
-        for (size_t i = 0; i < text_size; i++)
+        PROFILE_BEGIN_TS(phase_ts);
+
+        replace_batch = batch;
+        replace_batch_len = batch_len;
+        replace_symbol = next_symbol;
+        replace_lookup = NULL;
+        if (batch_len > 1)
+        {
+            // the batch shares no symbols, so each symbol starts at most one of its pairs and a single
+            // left to right pass gives the same text as merging them one after the other
+            uint32_t *batch_lookup = ctx.batch_lookup;
+            memset(batch_lookup, 0xff, next_symbol * sizeof(uint32_t));
+            for (size_t j = 0; j < batch_len; j++)
+                batch_lookup[batch[j].pair.a] = (uint32_t)j;
+            replace_lookup = batch_lookup;
+        }
+
+        // the pass that writes the new text also counts its pairs when it runs on the pool or when there is only
+        // one worker anyway; a serial pass with several workers leaves counting to them
+        bool parallel_replace = thread_no > 1 && text_size >= PARALLEL_REPLACE_MIN_LEN * thread_no;
+        replace_count = fused_count && (parallel_replace || thread_no == 1);
+        if (parallel_replace)
         {
-            if (i < text_size - 1 && text[i] == new_pair.a && text[i + 1] == new_pair.b)
+            worker_task = WORKER_TASK_REPLACE;
+            pthread_barrier_wait(&barrier);
+            pthread_barrier_wait(&barrier);
+
+            size_t new_text_size = 0;
+            for (size_t i = 0; i < thread_no; i++)
             {
-                temp[new_text_size++] = next_symbol;
-                i++;
+                replace_offset[i] = new_text_size;
+                new_text_size += replace_len[i];
             }
-            else
+
+            worker_task = WORKER_TASK_COMPACT;
+            pthread_barrier_wait(&barrier);
+
+            // the workers only counted inside their own slice, the pairs joining two slices are added here while
+            // they compact; temp isn't written by the compact pass so the slices can still be read from it
+            if (replace_count)
             {
-                temp[new_text_size++] = text[i];
+                size_t prev_end = SIZE_MAX;
+                for (size_t i = 0; i < thread_no; i++)
+                {
+                    if (!replace_len[i])
+                        continue;
+
+                    size_t start_index, chunk_len;
+                    static_partition(i, text_size, &start_index, &chunk_len);
+                    if (prev_end != SIZE_MAX)
+                    {
+                        count_pair(0, (pair_t){temp[prev_end], temp[start_index]});
+                        INSTRUMENT_ADD(worker_stats[0].pairs, 1);
+                    }
+                    prev_end = start_index + replace_len[i] - 1;
+                }
             }
+
+            pthread_barrier_wait(&barrier);
+            worker_task = WORKER_TASK_COUNT;
+
+            text_size = new_text_size;
         }
+        else
+        {
+            size_t new_text_size = replace_range(0, text_size, temp, replace_count, 0);
 
-        uint32_t *swap = text;
-        text = temp;
-        temp = swap;
-        text_size = new_text_size;
+            uint32_t *swap = text;
+            text = temp;
+            temp = swap;
+            text_size = new_text_size;
+        }
+        counts_ready = replace_count;
 
-        next_symbol++;
+        next_symbol += batch_len;
 
-        dyn_arr_free(node_arr);
-        hash_table_destroy(table);
+        PROFILE_ACCUM_TS(phase_ts, run_stats.replace_time);
+
+        if (checkpointer && next_symbol - 256 - last_checkpoint >= checkpoint_every &&
+            bpe_checkpointer_submit(checkpointer, pair_vec_data(pair_arr) + 256, next_symbol - 256, text, text_size,
+                                    original_text_size, corpus_hash))
+        {
+            last_checkpoint = next_symbol - 256;
+        }
+
+        if (progress && !((iteration + 1) % progress_every))
+        {
+            bpe_train_progress_t snapshot = {
+                .iteration = iteration,
+                .merges = next_symbol - 256,
+                .distinct_pairs = run_stats.distinct_pairs,
+                .best = max,
+                .text_size = text_size,
+                .input_bytes = original_text_size,
+            };
+            PROFILE_ACCUM_TS(total_ts, snapshot.elapsed);
+
+            if (!progress(&snapshot, opts->progress_user))
+                break;
+        }
     }
 
+    if (checkpointer && !bpe_checkpointer_stop(checkpointer, &run_stats.checkpoints))
+        fprintf(stderr, "Some checkpoints could not be written to %s\n", checkpoint_path);
+    checkpointer = NULL;
+
     *encoding = text;
     *len = text_size;
+    text = NULL;
     free(temp);
     temp = NULL;
+    train_ctx_free(&ctx);
 
     uint32_t *reallocated_encoding = realloc(*encoding, *len * sizeof(uint32_t));
     if (reallocated_encoding)
@@ -793,20 +1418,60 @@ dyn_arr_t *compress(const char *path, uint32_t **encoding, size_t *len)
         *encoding = reallocated_encoding;
     }
 
+    if (vocab_stats && !bpe_vocab_stats_count_tokens(vocab_stats, next_symbol, *encoding, *len))
+    {
+        // the encoding is already handed out, so it is put back for error_handling to free
+        text = *encoding;
+        goto error_handling;
+    }
+
     pthread_mutex_lock(&mutex);
     terminate = 1;
     pthread_mutex_unlock(&mutex);
 
     pthread_barrier_wait(&barrier);
 
-    for (size_t i = 0; i < THREAD_NO; i++)
+    for (size_t i = 0; i < thread_no; i++)
     {
         void *status;
         pthread_join(worker_threads[i], &status);
     }
 
-    for (size_t i = 0; i < THREAD_NO; i++)
+    pthread_barrier_destroy(&barrier);
+
+    for (size_t i = 0; i < thread_no; i++)
+    {
         hash_table_destroy(thread_tables[i]);
+        thread_tables[i] = NULL;
+    }
+
+    sharded_hash_table_destroy(shared_table);
+    shared_table = NULL;
+
+    for (size_t i = 0; i < thread_no; i++)
+    {
+        pair_store_free(thread_stores[i]);
+        thread_stores[i] = NULL;
+    }
+
+    if (stats)
+    {
+        PROFILE_ACCUM_TS(total_ts, run_stats.total_time);
+        run_stats.input_bytes = original_text_size;
+        run_stats.output_len = *len;
+        run_stats.merges = next_symbol - 256;
+        run_stats.thread_no = thread_no;
+#ifdef BPE_INSTRUMENT
+        run_stats.instrumented = true;
+        for (size_t i = 0; i < thread_no; i++)
+        {
+            run_stats.worker_count_time[i] = worker_stats[i].count_time;
+            run_stats.worker_wait_time[i] = worker_stats[i].wait_time;
+            run_stats.worker_pairs[i] = worker_stats[i].pairs;
+        }
+#endif
+        *stats = run_stats;
+    }
 
     return pair_arr;
 
@@ -819,7 +1484,7 @@ error_handling:
 
         pthread_barrier_wait(&barrier);
 
-        for (size_t i = 0; i < THREAD_NO; i++)
+        for (size_t i = 0; i < thread_no; i++)
         {
             void *status;
             if (worker_threads[i] != 0)
@@ -827,18 +1492,38 @@ error_handling:
                 pthread_join(worker_threads[i], &status);
             }
         }
+
+        pthread_barrier_destroy(&barrier);
     }
 
-    for (size_t i = 0; i < THREAD_NO; i++)
+    for (size_t i = 0; i < thread_no; i++)
+    {
         hash_table_destroy(thread_tables[i]);
+        thread_tables[i] = NULL;
+    }
+
+    sharded_hash_table_destroy(shared_table);
+    shared_table = NULL;
 
+    for (size_t i = 0; i < thread_no; i++)
+    {
+        pair_store_free(thread_stores[i]);
+        thread_stores[i] = NULL;
+    }
+
+    train_ctx_free(&ctx);
+    bpe_checkpointer_stop(checkpointer, NULL);
+    bpe_vocab_stats_free(vocab_stats);
+    free(text_buffer);
     if (pair_arr)
         dyn_arr_free(pair_arr);
     if (text)
         free(text);
     if (temp)
         free(temp);
+    text = NULL;
+    temp = NULL;
     *encoding = NULL;
     *len = 0;
     return NULL;
-}
\ No newline at end of file
+}
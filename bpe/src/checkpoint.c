@@ -0,0 +1,307 @@
+#include "../inc/bpe.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC "BPECKPT1"
+#define CHECKPOINT_VERSION 1
+
+// on disk layout: this header, merges pair_t records (the merges after the 256 byte tokens),
+// then text_size uint32_t symbols, all in host byte order
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t input_bytes;
+    uint64_t corpus_hash;
+    uint64_t merges;
+    uint64_t text_size;
+} checkpoint_header_t;
+
+uint64_t bpe_corpus_hash(const uint8_t *bytes, size_t len)
+{
+    // fnv-1a, only used to tell whether a checkpoint was made from the same corpus
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+bool bpe_checkpoint_write(const char *path, const pair_t *merges, size_t num_merges, const uint32_t *text, size_t text_size,
+                          uint64_t input_bytes, uint64_t corpus_hash)
+{
+    if (!path || (!merges && num_merges) || (!text && text_size))
+        return false;
+
+    size_t path_len = strlen(path);
+    char *tmp_path = (char *)malloc(path_len + sizeof(".tmp"));
+    if (!tmp_path)
+        return false;
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", sizeof(".tmp"));
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file)
+    {
+        perror("fopen");
+        free(tmp_path);
+        return false;
+    }
+
+    checkpoint_header_t header = {
+        .version = CHECKPOINT_VERSION,
+        .input_bytes = input_bytes,
+        .corpus_hash = corpus_hash,
+        .merges = num_merges,
+        .text_size = text_size,
+    };
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(merges, sizeof(pair_t), num_merges, file) == num_merges &&
+              fwrite(text, sizeof(uint32_t), text_size, file) == text_size &&
+              !fflush(file) && !fsync(fileno(file));
+    if (fclose(file))
+        ok = false;
+
+    // the rename only happens once the new checkpoint is complete on disk, so a crash at any point
+    // leaves either the previous checkpoint or this one
+    if (!ok || rename(tmp_path, path))
+    {
+        perror("checkpoint");
+        remove(tmp_path);
+        free(tmp_path);
+        return false;
+    }
+
+    free(tmp_path);
+    return true;
+}
+
+bool bpe_checkpoint_read(const char *path, uint64_t input_bytes, uint64_t corpus_hash, pair_t **merges, size_t *num_merges,
+                         uint32_t **text, size_t *text_size)
+{
+    if (!path || !merges || !num_merges || !text || !text_size)
+        return false;
+
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    checkpoint_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) ||
+        header.version != CHECKPOINT_VERSION)
+    {
+        fprintf(stderr, "%s is not a checkpoint\n", path);
+        fclose(file);
+        return false;
+    }
+
+    if (header.input_bytes != input_bytes || header.corpus_hash != corpus_hash || header.text_size > input_bytes ||
+        header.merges > UINT32_MAX - 256)
+    {
+        fprintf(stderr, "%s was made from a different corpus\n", path);
+        fclose(file);
+        return false;
+    }
+
+    *merges = (pair_t *)malloc((header.merges ? header.merges : 1) * sizeof(pair_t));
+    *text = (uint32_t *)malloc((header.text_size ? header.text_size : 1) * sizeof(uint32_t));
+    if (!*merges || !*text || fread(*merges, sizeof(pair_t), header.merges, file) != header.merges ||
+        fread(*text, sizeof(uint32_t), header.text_size, file) != header.text_size)
+    {
+        fprintf(stderr, "%s is truncated\n", path);
+        free(*merges);
+        free(*text);
+        *merges = NULL;
+        *text = NULL;
+        fclose(file);
+        return false;
+    }
+
+    fclose(file);
+
+    // the corpus hash says nothing about the checkpoint itself, a symbol past the saved merges means it is corrupt
+    for (size_t i = 0; i < header.text_size; i++)
+    {
+        if ((*text)[i] >= 256 + header.merges)
+        {
+            fprintf(stderr, "%s holds a symbol past its merges\n", path);
+            free(*merges);
+            free(*text);
+            *merges = NULL;
+            *text = NULL;
+            return false;
+        }
+    }
+
+    *num_merges = header.merges;
+    *text_size = header.text_size;
+    return true;
+}
+
+struct bpe_checkpointer
+{
+    char *path;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool pending; // a snapshot is waiting for or being written
+    bool stop;
+    size_t written;
+    size_t failed;
+
+    // snapshot owned by the writer while pending is set, grown as training needs
+    pair_t *merges;
+    size_t num_merges;
+    size_t merges_cap;
+    uint32_t *text;
+    size_t text_size;
+    size_t text_cap;
+    uint64_t input_bytes;
+    uint64_t corpus_hash;
+};
+
+static void *checkpoint_writer(void *arg)
+{
+    bpe_checkpointer_t *ckpt = (bpe_checkpointer_t *)arg;
+
+    pthread_mutex_lock(&ckpt->mutex);
+    while (true)
+    {
+        while (!ckpt->pending && !ckpt->stop)
+            pthread_cond_wait(&ckpt->cond, &ckpt->mutex);
+
+        if (!ckpt->pending)
+            break;
+
+        // the snapshot is only touched by this thread until pending is cleared
+        pthread_mutex_unlock(&ckpt->mutex);
+        bool ok = bpe_checkpoint_write(ckpt->path, ckpt->merges, ckpt->num_merges, ckpt->text, ckpt->text_size,
+                                       ckpt->input_bytes, ckpt->corpus_hash);
+        pthread_mutex_lock(&ckpt->mutex);
+
+        if (ok)
+            ckpt->written++;
+        else
+            ckpt->failed++;
+        ckpt->pending = false;
+    }
+    pthread_mutex_unlock(&ckpt->mutex);
+
+    return NULL;
+}
+
+bpe_checkpointer_t *bpe_checkpointer_start(const char *path)
+{
+    if (!path)
+        return NULL;
+
+    bpe_checkpointer_t *ckpt = (bpe_checkpointer_t *)calloc(1, sizeof(bpe_checkpointer_t));
+    if (!ckpt)
+        return NULL;
+
+    ckpt->path = strdup(path);
+    if (!ckpt->path || pthread_mutex_init(&ckpt->mutex, NULL))
+    {
+        free(ckpt->path);
+        free(ckpt);
+        return NULL;
+    }
+
+    if (pthread_cond_init(&ckpt->cond, NULL))
+    {
+        pthread_mutex_destroy(&ckpt->mutex);
+        free(ckpt->path);
+        free(ckpt);
+        return NULL;
+    }
+
+    if (pthread_create(&ckpt->thread, NULL, checkpoint_writer, ckpt))
+    {
+        pthread_cond_destroy(&ckpt->cond);
+        pthread_mutex_destroy(&ckpt->mutex);
+        free(ckpt->path);
+        free(ckpt);
+        return NULL;
+    }
+
+    return ckpt;
+}
+
+bool bpe_checkpointer_submit(bpe_checkpointer_t *ckpt, const pair_t *merges, size_t num_merges, const uint32_t *text,
+                             size_t text_size, uint64_t input_bytes, uint64_t corpus_hash)
+{
+    if (!ckpt)
+        return false;
+
+    pthread_mutex_lock(&ckpt->mutex);
+    bool busy = ckpt->pending;
+    pthread_mutex_unlock(&ckpt->mutex);
+
+    // never wait for the disk on the training thread, a checkpoint due while the last one is still
+    // being written is skipped and the next one picks up from there
+    if (busy)
+        return false;
+
+    if (num_merges > ckpt->merges_cap)
+    {
+        size_t cap = num_merges * 2;
+        pair_t *grown = (pair_t *)realloc(ckpt->merges, cap * sizeof(pair_t));
+        if (!grown)
+            return false;
+        ckpt->merges = grown;
+        ckpt->merges_cap = cap;
+    }
+
+    if (text_size > ckpt->text_cap)
+    {
+        uint32_t *grown = (uint32_t *)realloc(ckpt->text, text_size * sizeof(uint32_t));
+        if (!grown)
+            return false;
+        ckpt->text = grown;
+        ckpt->text_cap = text_size;
+    }
+
+    // a memcpy of the state is all the training thread pays, the write happens on the writer thread
+    memcpy(ckpt->merges, merges, num_merges * sizeof(pair_t));
+    memcpy(ckpt->text, text, text_size * sizeof(uint32_t));
+    ckpt->num_merges = num_merges;
+    ckpt->text_size = text_size;
+    ckpt->input_bytes = input_bytes;
+    ckpt->corpus_hash = corpus_hash;
+
+    pthread_mutex_lock(&ckpt->mutex);
+    ckpt->pending = true;
+    pthread_cond_signal(&ckpt->cond);
+    pthread_mutex_unlock(&ckpt->mutex);
+
+    return true;
+}
+
+bool bpe_checkpointer_stop(bpe_checkpointer_t *ckpt, size_t *written)
+{
+    if (!ckpt)
+        return false;
+
+    // the writer finishes a pending snapshot before it looks at stop
+    pthread_mutex_lock(&ckpt->mutex);
+    ckpt->stop = true;
+    pthread_cond_signal(&ckpt->cond);
+    pthread_mutex_unlock(&ckpt->mutex);
+
+    pthread_join(ckpt->thread, NULL);
+
+    bool ok = !ckpt->failed;
+    if (written)
+        *written = ckpt->written;
+
+    pthread_cond_destroy(&ckpt->cond);
+    pthread_mutex_destroy(&ckpt->mutex);
+    free(ckpt->merges);
+    free(ckpt->text);
+    free(ckpt->path);
+    free(ckpt);
+    return ok;
+}
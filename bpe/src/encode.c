@@ -0,0 +1,153 @@
+#include "../inc/bpe.h"
+
+// a candidate merge of the symbol at pos with the one after it
+typedef struct
+{
+    uint32_t rank;
+    size_t pos;
+} merge_cand_t;
+
+static inline bool cand_before(const merge_cand_t *x, const merge_cand_t *y)
+{
+    // lowest rank first, leftmost first among equal ranks so runs like "aaa" pair up the same way
+    // the left to right replacement in compress() does
+    return x->rank < y->rank || (x->rank == y->rank && x->pos < y->pos);
+}
+
+static void heap_push(merge_cand_t *heap, size_t *heap_len, merge_cand_t cand)
+{
+    size_t child = (*heap_len)++;
+    while (child)
+    {
+        size_t parent = (child - 1) / 2;
+        if (!cand_before(&cand, &heap[parent]))
+            break;
+
+        heap[child] = heap[parent];
+        child = parent;
+    }
+    heap[child] = cand;
+}
+
+static merge_cand_t heap_pop(merge_cand_t *heap, size_t *heap_len)
+{
+    merge_cand_t top = heap[0];
+    merge_cand_t last = heap[--(*heap_len)];
+
+    size_t parent = 0;
+    while (true)
+    {
+        size_t child = 2 * parent + 1;
+        if (child >= *heap_len)
+            break;
+
+        if (child + 1 < *heap_len && cand_before(&heap[child + 1], &heap[child]))
+            child++;
+
+        if (!cand_before(&heap[child], &last))
+            break;
+
+        heap[parent] = heap[child];
+        parent = child;
+    }
+
+    if (*heap_len)
+        heap[parent] = last;
+
+    return top;
+}
+
+#define NO_POS SIZE_MAX
+
+bool bpe_encode(const bpe_model_t *model, const uint8_t *bytes, size_t len, uint32_t **encoding, size_t *encoding_len)
+{
+    if (!model || (!bytes && len) || !encoding || !encoding_len)
+    {
+        return false;
+    }
+
+    uint32_t *symbols = (uint32_t *)malloc((len ? len : 1) * sizeof(uint32_t));
+    size_t *next = (size_t *)malloc((len ? len : 1) * sizeof(size_t));
+    size_t *prev = (size_t *)malloc((len ? len : 1) * sizeof(size_t));
+    // every merge adds at most two candidates on top of the initial len - 1
+    size_t heap_cap = len ? 3 * len : 1;
+    merge_cand_t *heap = (merge_cand_t *)malloc(heap_cap * sizeof(merge_cand_t));
+    if (!symbols || !next || !prev || !heap)
+    {
+        free(symbols);
+        free(next);
+        free(prev);
+        free(heap);
+        return false;
+    }
+
+    size_t heap_len = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        symbols[i] = bytes[i];
+        next[i] = i + 1 < len ? i + 1 : NO_POS;
+        prev[i] = i ? i - 1 : NO_POS;
+    }
+
+    for (size_t i = 0; i + 1 < len; i++)
+    {
+        pair_t pair = {symbols[i], symbols[i + 1]};
+        uint32_t rank;
+        if (pair_store_get(model->rank_store, pair, &rank))
+        {
+            heap_push(heap, &heap_len, (merge_cand_t){rank, i});
+        }
+    }
+
+    pair_t merge;
+    while (heap_len)
+    {
+        merge_cand_t cand = heap_pop(heap, &heap_len);
+        size_t right = next[cand.pos];
+
+        // candidates are never removed eagerly, drop the ones an earlier merge made stale
+        if (right == NO_POS || !dyn_arr_get(model->pair_arr, cand.rank, &merge) || symbols[cand.pos] != merge.a ||
+            symbols[right] != merge.b)
+        {
+            continue;
+        }
+
+        symbols[cand.pos] = cand.rank;
+        next[cand.pos] = next[right];
+        if (next[right] != NO_POS)
+            prev[next[right]] = cand.pos;
+        // a dead slot has no successor, so stale candidates starting there fail the check above
+        next[right] = NO_POS;
+
+        uint32_t rank;
+        if (prev[cand.pos] != NO_POS)
+        {
+            pair_t pair = {symbols[prev[cand.pos]], cand.rank};
+            if (pair_store_get(model->rank_store, pair, &rank))
+                heap_push(heap, &heap_len, (merge_cand_t){rank, prev[cand.pos]});
+        }
+        if (next[cand.pos] != NO_POS)
+        {
+            pair_t pair = {cand.rank, symbols[next[cand.pos]]};
+            if (pair_store_get(model->rank_store, pair, &rank))
+                heap_push(heap, &heap_len, (merge_cand_t){rank, cand.pos});
+        }
+    }
+
+    size_t out_len = 0;
+    for (size_t i = len ? 0 : NO_POS; i != NO_POS; i = next[i])
+    {
+        symbols[out_len++] = symbols[i];
+    }
+
+    free(next);
+    free(prev);
+    free(heap);
+
+    uint32_t *shrunk = realloc(symbols, (out_len ? out_len : 1) * sizeof(uint32_t));
+    *encoding = shrunk ? shrunk : symbols;
+    *encoding_len = out_len;
+    return true;
+}
+
+#undef NO_POS
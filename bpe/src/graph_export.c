@@ -0,0 +1,135 @@
+#include "../inc/bpe.h"
+
+// depth: 0 for a byte, one more than the deeper part for a merge. fan_in: how many merges use a token as a part
+static bool graph_measure(dyn_arr_t *pair_arr, uint32_t **depth, uint32_t **fan_in)
+{
+    size_t num_of_tokens = pair_arr->last_index + 1;
+    *depth = (uint32_t *)calloc(num_of_tokens, sizeof(uint32_t));
+    *fan_in = (uint32_t *)calloc(num_of_tokens, sizeof(uint32_t));
+    if (!*depth || !*fan_in)
+    {
+        free(*depth);
+        free(*fan_in);
+        return false;
+    }
+
+    // parts always come before the token, so one forward pass sees every part's depth first
+    for (size_t token = 256; token < num_of_tokens; token++)
+    {
+        pair_t pair;
+        if (!dyn_arr_get(pair_arr, token, &pair) || pair.a >= token || pair.b >= token)
+        {
+            fprintf(stderr, "Invalid merge at index %zu\n", token);
+            free(*depth);
+            free(*fan_in);
+            return false;
+        }
+
+        (*depth)[token] = 1 + ((*depth)[pair.a] > (*depth)[pair.b] ? (*depth)[pair.a] : (*depth)[pair.b]);
+        (*fan_in)[pair.a]++;
+        (*fan_in)[pair.b]++;
+    }
+
+    return true;
+}
+
+static void export_dot(dyn_arr_t *pair_arr, FILE *out, size_t first, const uint32_t *depth, const uint32_t *fan_in)
+{
+    fprintf(out, "digraph Pairs {\n");
+    for (size_t token = first; token <= pair_arr->last_index; token++)
+        fprintf(out, "%zu [depth=%u, fan_in=%u];\n", token, depth[token], fan_in[token]);
+
+    for (size_t token = 256; token <= pair_arr->last_index; token++)
+    {
+        pair_t pair;
+        dyn_arr_get(pair_arr, token, &pair);
+        fprintf(out, "%zu -> %u;\n", token, pair.a);
+        fprintf(out, "%zu -> %u;\n", token, pair.b);
+    }
+    fprintf(out, "}\n");
+}
+
+static void export_graphml(dyn_arr_t *pair_arr, FILE *out, size_t first, const uint32_t *depth, const uint32_t *fan_in)
+{
+    fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                 "<graphml xmlns=\"http://graphml.graphdrawing.org/xmlns\">\n"
+                 "<key id=\"depth\" for=\"node\" attr.name=\"depth\" attr.type=\"int\"/>\n"
+                 "<key id=\"fan_in\" for=\"node\" attr.name=\"fan_in\" attr.type=\"int\"/>\n"
+                 "<key id=\"side\" for=\"edge\" attr.name=\"side\" attr.type=\"string\"/>\n"
+                 "<graph id=\"pairs\" edgedefault=\"directed\">\n");
+    for (size_t token = first; token <= pair_arr->last_index; token++)
+        fprintf(out, "<node id=\"n%zu\"><data key=\"depth\">%u</data><data key=\"fan_in\">%u</data></node>\n", token, depth[token],
+                fan_in[token]);
+
+    for (size_t token = 256; token <= pair_arr->last_index; token++)
+    {
+        pair_t pair;
+        dyn_arr_get(pair_arr, token, &pair);
+        fprintf(out, "<edge source=\"n%zu\" target=\"n%u\"><data key=\"side\">left</data></edge>\n", token, pair.a);
+        fprintf(out, "<edge source=\"n%zu\" target=\"n%u\"><data key=\"side\">right</data></edge>\n", token, pair.b);
+    }
+    fprintf(out, "</graph>\n</graphml>\n");
+}
+
+static void export_json(dyn_arr_t *pair_arr, FILE *out, size_t first, const uint32_t *depth, const uint32_t *fan_in)
+{
+    fprintf(out, "{\"nodes\":[");
+    for (size_t token = first; token <= pair_arr->last_index; token++)
+        fprintf(out, "%s\n{\"id\":%zu,\"depth\":%u,\"fan_in\":%u}", token == first ? "" : ",", token, depth[token], fan_in[token]);
+
+    // edges are [token, part, 0 for the left part or 1 for the right one]
+    fprintf(out, "\n],\"edges\":[");
+    for (size_t token = 256; token <= pair_arr->last_index; token++)
+    {
+        pair_t pair;
+        dyn_arr_get(pair_arr, token, &pair);
+        fprintf(out, "%s\n[%zu,%u,0],\n[%zu,%u,1]", token == 256 ? "" : ",", token, pair.a, token, pair.b);
+    }
+    fprintf(out, "\n]}\n");
+}
+
+bool bpe_graph_export(dyn_arr_t *pair_arr, FILE *out, bpe_graph_format_t format, bool include_bytes, bpe_graph_stats_t *stats)
+{
+    if (!pair_arr || pair_arr->last_index < 255 || (!out && !stats))
+        return false;
+
+    uint32_t *depth, *fan_in;
+    if (!graph_measure(pair_arr, &depth, &fan_in))
+        return false;
+
+    size_t first = include_bytes ? 0 : 256;
+    if (out && format == BPE_GRAPH_GRAPHML)
+        export_graphml(pair_arr, out, first, depth, fan_in);
+    else if (out && format == BPE_GRAPH_JSON)
+        export_json(pair_arr, out, first, depth, fan_in);
+    else if (out)
+        export_dot(pair_arr, out, first, depth, fan_in);
+
+    if (stats)
+    {
+        memset(stats, 0, sizeof(bpe_graph_stats_t));
+        stats->num_of_merges = pair_arr->last_index - 255;
+
+        size_t depth_sum = 0;
+        for (size_t token = 0; token <= pair_arr->last_index; token++)
+        {
+            if (fan_in[token] > stats->max_fan_in)
+            {
+                stats->max_fan_in = fan_in[token];
+                stats->max_fan_in_token = (uint32_t)token;
+            }
+
+            if (token < 256)
+                continue;
+
+            depth_sum += depth[token];
+            stats->max_depth = depth[token] > stats->max_depth ? depth[token] : stats->max_depth;
+            stats->num_of_roots += !fan_in[token];
+        }
+        stats->avg_depth = stats->num_of_merges ? (double)depth_sum / stats->num_of_merges : 0;
+    }
+
+    free(depth);
+    free(fan_in);
+    return !out || (!ferror(out) && !fflush(out));
+}
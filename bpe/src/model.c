@@ -0,0 +1,217 @@
+#include "../inc/bpe.h"
+
+bpe_model_t *bpe_model_create(dyn_arr_t *pair_arr)
+{
+    if (!pair_arr || pair_arr->last_index < 255)
+    {
+        return NULL;
+    }
+
+    bpe_model_t *model = (bpe_model_t *)calloc(1, sizeof(bpe_model_t));
+    if (!model)
+    {
+        return NULL;
+    }
+
+    model->pair_arr = pair_arr;
+    model->num_of_tokens = pair_arr->last_index + 1;
+
+    model->token_len = (uint32_t *)malloc(model->num_of_tokens * sizeof(uint32_t));
+    model->token_offset = (size_t *)malloc(model->num_of_tokens * sizeof(size_t));
+    pair_t *pairs = (pair_t *)malloc(model->num_of_tokens * sizeof(pair_t));
+    if (!model->token_len || !model->token_offset || !pairs)
+    {
+        free(pairs);
+        bpe_model_free(model);
+        return NULL;
+    }
+
+    // merges only ever reference tokens created before them, so a single forward pass
+    // is enough to compute every length
+    size_t offset = 0;
+    for (size_t index = 0; index < model->num_of_tokens; index++)
+    {
+        if (!dyn_arr_get(pair_arr, index, &pairs[index]))
+        {
+            free(pairs);
+            bpe_model_free(model);
+            return NULL;
+        }
+
+        pair_t pair = pairs[index];
+        if (index < 256)
+        {
+            model->token_len[index] = 1;
+        }
+        else if (pair.a < index && pair.b < index)
+        {
+            model->token_len[index] = model->token_len[pair.a] + model->token_len[pair.b];
+        }
+        else
+        {
+            fprintf(stderr, "Invalid merge at index %zu\n", index);
+            free(pairs);
+            bpe_model_free(model);
+            return NULL;
+        }
+
+        model->token_offset[index] = offset;
+        offset += model->token_len[index];
+    }
+
+    model->rank_store = pair_store_create(model->num_of_tokens);
+    if (!model->rank_store)
+    {
+        free(pairs);
+        bpe_model_free(model);
+        return NULL;
+    }
+
+    for (uint32_t index = 256; index < model->num_of_tokens; index++)
+    {
+        // a pair can only be merged once, the first id it got is its rank
+        uint32_t rank;
+        if (!pair_store_get(model->rank_store, pairs[index], &rank) && !pair_store_set(model->rank_store, pairs[index], index))
+        {
+            free(pairs);
+            bpe_model_free(model);
+            return NULL;
+        }
+    }
+
+    model->bytes_len = offset;
+    model->token_bytes = (uint8_t *)malloc(model->bytes_len);
+    if (!model->token_bytes)
+    {
+        free(pairs);
+        bpe_model_free(model);
+        return NULL;
+    }
+
+    for (size_t index = 0; index < model->num_of_tokens; index++)
+    {
+        uint8_t *dest = model->token_bytes + model->token_offset[index];
+        if (index < 256)
+        {
+            *dest = (uint8_t)index;
+            continue;
+        }
+
+        pair_t pair = pairs[index];
+        memcpy(dest, model->token_bytes + model->token_offset[pair.a], model->token_len[pair.a]);
+        memcpy(dest + model->token_len[pair.a], model->token_bytes + model->token_offset[pair.b], model->token_len[pair.b]);
+    }
+
+    free(pairs);
+    return model;
+}
+
+void bpe_model_free(bpe_model_t *model)
+{
+    if (!model)
+    {
+        return;
+    }
+
+    free(model->token_len);
+    free(model->token_offset);
+    free(model->token_bytes);
+    pair_store_free(model->rank_store);
+    free(model->merge_freq);
+    free(model->token_freq);
+    free(model->token_bits);
+    free(model);
+}
+
+size_t bpe_decoded_size(const bpe_model_t *model, const uint32_t *tokens, size_t len)
+{
+    if (!model || (!tokens && len))
+    {
+        return SIZE_MAX;
+    }
+
+    // validate first so the summing loop below is a plain gather-and-add the compiler can vectorize
+    uint32_t max_token = 0;
+    for (size_t index = 0; index < len; index++)
+    {
+        max_token = tokens[index] > max_token ? tokens[index] : max_token;
+    }
+
+    if (len && max_token >= model->num_of_tokens)
+    {
+        return SIZE_MAX;
+    }
+
+    const uint32_t *token_len = model->token_len;
+    size_t total = 0;
+    for (size_t index = 0; index < len; index++)
+    {
+        total += token_len[tokens[index]];
+    }
+
+    return total;
+}
+
+size_t bpe_decode_into(const bpe_model_t *model, const uint32_t *tokens, size_t len, uint8_t *dst, size_t cap)
+{
+    size_t total = bpe_decoded_size(model, tokens, len);
+    if (total == SIZE_MAX || total > cap || (!dst && total))
+    {
+        return SIZE_MAX;
+    }
+
+    const uint32_t *token_len = model->token_len;
+    const size_t *token_offset = model->token_offset;
+    const uint8_t *token_bytes = model->token_bytes;
+
+    uint8_t *pos = dst;
+    for (size_t index = 0; index < len; index++)
+    {
+        uint32_t token = tokens[index];
+        memcpy(pos, token_bytes + token_offset[token], token_len[token]);
+        pos += token_len[token];
+    }
+
+    return total;
+}
+
+size_t bpe_decode_iov(const bpe_model_t *model, const uint32_t *tokens, size_t len, struct iovec *iov, size_t iov_cap, size_t *consumed)
+{
+    if (!model || (!tokens && len) || !iov || !consumed)
+    {
+        return SIZE_MAX;
+    }
+
+    size_t iov_len = 0;
+    size_t index = 0;
+    for (; index < len; index++)
+    {
+        uint32_t token = tokens[index];
+        if (token >= model->num_of_tokens)
+        {
+            return SIZE_MAX;
+        }
+
+        uint8_t *base = model->token_bytes + model->token_offset[token];
+        size_t token_len = model->token_len[token];
+
+        // tokens whose bytes are adjacent in the arena (e.g. consecutive byte values) collapse into one slice
+        if (iov_len && (uint8_t *)iov[iov_len - 1].iov_base + iov[iov_len - 1].iov_len == base)
+        {
+            iov[iov_len - 1].iov_len += token_len;
+            continue;
+        }
+
+        if (iov_len == iov_cap)
+        {
+            break;
+        }
+
+        iov[iov_len].iov_base = base;
+        iov[iov_len].iov_len = token_len;
+        iov_len++;
+    }
+
+    *consumed = index;
+    return iov_len;
+}
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include "../inc/bpe.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#define NODE_SYSFS_PATH "/sys/devices/system/node"
+#define CPULIST_LINE_LEN 4096
+
+// parses a sysfs cpulist like "0-3,8-11" into cpus, returns how many were read
+static size_t parse_cpulist(const char *list, int *cpus, size_t cap)
+{
+    size_t len = 0;
+    const char *pos = list;
+    while (*pos && *pos != '\n' && len < cap)
+    {
+        char *end;
+        long first = strtol(pos, &end, 10);
+        if (end == pos)
+            break;
+
+        long last = first;
+        if (*end == '-')
+        {
+            pos = end + 1;
+            last = strtol(pos, &end, 10);
+            if (end == pos)
+                break;
+        }
+
+        for (long cpu = first; cpu <= last && len < cap; cpu++)
+            cpus[len++] = (int)cpu;
+
+        pos = *end == ',' ? end + 1 : end;
+    }
+
+    return len;
+}
+
+static size_t read_node_cpus(size_t node, int *cpus, size_t cap)
+{
+    char path[128];
+    snprintf(path, sizeof(path), NODE_SYSFS_PATH "/node%zu/cpulist", node);
+
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return 0;
+
+    char line[CPULIST_LINE_LEN];
+    size_t len = fgets(line, sizeof(line), file) ? parse_cpulist(line, cpus, cap) : 0;
+    fclose(file);
+    return len;
+}
+
+bool bpe_numa_plan(size_t thread_no, bpe_numa_plan_t *plan)
+{
+    if (!plan || !thread_no || thread_no > BPE_MAX_THREAD_NO)
+        return false;
+
+    memset(plan, 0, sizeof(bpe_numa_plan_t));
+
+    // nodes without cpus (memory only) can't run workers, so they are left out
+    size_t node_ids[BPE_MAX_NUMA_NODES];
+    size_t node_cpu_len[BPE_MAX_NUMA_NODES];
+    int node_cpus[BPE_MAX_NUMA_NODES][BPE_MAX_THREAD_NO];
+    size_t misses = 0;
+    for (size_t node = 0; plan->num_of_nodes < BPE_MAX_NUMA_NODES && misses < BPE_MAX_NUMA_NODES; node++)
+    {
+        size_t len = read_node_cpus(node, node_cpus[plan->num_of_nodes], BPE_MAX_THREAD_NO);
+        if (!len)
+        {
+            // node ids can have holes, stop after a run of missing ones
+            misses++;
+            continue;
+        }
+
+        misses = 0;
+        node_ids[plan->num_of_nodes] = node;
+        node_cpu_len[plan->num_of_nodes] = len;
+        plan->num_of_nodes++;
+    }
+
+    if (!plan->num_of_nodes)
+    {
+        // no sysfs topology: one node, workers left to the scheduler
+        plan->num_of_nodes = 1;
+        for (size_t i = 0; i < thread_no; i++)
+        {
+            plan->worker_node[i] = 0;
+            plan->worker_cpu[i] = -1;
+        }
+        return true;
+    }
+
+    // consecutive workers go to the same node, so neighbouring corpus partitions share a node's memory
+    for (size_t i = 0; i < thread_no; i++)
+    {
+        size_t node = i * plan->num_of_nodes / thread_no;
+        size_t first_on_node = (node * thread_no + plan->num_of_nodes - 1) / plan->num_of_nodes;
+        plan->worker_node[i] = (int)node_ids[node];
+        plan->worker_cpu[i] = node_cpus[node][(i - first_on_node) % node_cpu_len[node]];
+    }
+
+    return true;
+}
+
+bool bpe_numa_pin_self(int cpu)
+{
+    if (cpu < 0)
+        return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return !pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+}
@@ -0,0 +1,214 @@
+#include "../inc/bpe.h"
+
+#define ROW_MIN_CAPACITY 4
+#define ROW_GROWTH_CUTOFF(row) (((size_t)(row)->mask + 1) * 3 / 4)
+
+// b is usually a dense run of small ids, the mix keeps runs with a stride (only even ids, ...) spread out
+#define SLOT_OF(row, b) ((((b) * 0x9e3779b1U) ^ (((b) * 0x9e3779b1U) >> 16)) & (row)->mask)
+
+pair_store_t *pair_store_create(size_t num_of_rows)
+{
+    pair_store_t *store = (pair_store_t *)malloc(sizeof(pair_store_t));
+    if (!store)
+        return NULL;
+
+    store->num_of_rows = num_of_rows ? num_of_rows : 1;
+    store->num_of_pairs = 0;
+    store->rows = (pair_row_t *)calloc(store->num_of_rows, sizeof(pair_row_t));
+    if (!store->rows)
+    {
+        free(store);
+        return NULL;
+    }
+
+    return store;
+}
+
+void pair_store_free(pair_store_t *store)
+{
+    if (!store)
+        return;
+
+    for (size_t i = 0; i < store->num_of_rows; i++)
+        free(store->rows[i].slots);
+
+    free(store->rows);
+    free(store);
+}
+
+static bool grow_rows(pair_store_t *store, uint32_t a)
+{
+    size_t num_of_rows = store->num_of_rows * 2 > (size_t)a + 1 ? store->num_of_rows * 2 : (size_t)a + 1;
+    pair_row_t *rows = (pair_row_t *)realloc(store->rows, num_of_rows * sizeof(pair_row_t));
+    if (!rows)
+        return false;
+
+    memset(rows + store->num_of_rows, 0, (num_of_rows - store->num_of_rows) * sizeof(pair_row_t));
+    store->rows = rows;
+    store->num_of_rows = num_of_rows;
+    return true;
+}
+
+static bool grow_row(pair_row_t *row)
+{
+    size_t old_capacity = row->slots ? (size_t)row->mask + 1 : 0;
+    size_t capacity = old_capacity ? old_capacity * 2 : ROW_MIN_CAPACITY;
+    pair_slot_t *slots = (pair_slot_t *)malloc(capacity * sizeof(pair_slot_t));
+    if (!slots)
+        return false;
+
+    memset(slots, 0xff, capacity * sizeof(pair_slot_t));
+
+    pair_slot_t *old_slots = row->slots;
+    row->slots = slots;
+    row->mask = (uint32_t)(capacity - 1);
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_slots[i].b == PAIR_STORE_EMPTY)
+            continue;
+
+        uint32_t slot = SLOT_OF(row, old_slots[i].b);
+        while (slots[slot].b != PAIR_STORE_EMPTY)
+            slot = (slot + 1) & row->mask;
+        slots[slot] = old_slots[i];
+    }
+
+    free(old_slots);
+    return true;
+}
+
+// returns the slot holding b, or the empty slot b would go into
+static inline pair_slot_t *find_slot(const pair_row_t *row, uint32_t b)
+{
+    uint32_t slot = SLOT_OF(row, b);
+    while (row->slots[slot].b != b && row->slots[slot].b != PAIR_STORE_EMPTY)
+        slot = (slot + 1) & row->mask;
+
+    return &row->slots[slot];
+}
+
+static pair_slot_t *get_or_add_slot(pair_store_t *store, pair_t pair)
+{
+    if (pair.a >= store->num_of_rows && !grow_rows(store, pair.a))
+        return NULL;
+
+    pair_row_t *row = &store->rows[pair.a];
+    if (row->slots)
+    {
+        pair_slot_t *slot = find_slot(row, pair.b);
+        if (slot->b == pair.b)
+            return slot;
+    }
+
+    if ((!row->slots || row->len + 1 > ROW_GROWTH_CUTOFF(row)) && !grow_row(row))
+        return NULL;
+
+    pair_slot_t *slot = find_slot(row, pair.b);
+    slot->b = pair.b;
+    slot->value = 0;
+    row->len++;
+    store->num_of_pairs++;
+    return slot;
+}
+
+bool pair_store_add(pair_store_t *store, pair_t pair, uint32_t delta)
+{
+    if (!store || pair.b == PAIR_STORE_EMPTY)
+        return false;
+
+    pair_slot_t *slot = get_or_add_slot(store, pair);
+    if (!slot)
+        return false;
+
+    slot->value += delta;
+    return true;
+}
+
+bool pair_store_set(pair_store_t *store, pair_t pair, uint32_t value)
+{
+    if (!store || pair.b == PAIR_STORE_EMPTY)
+        return false;
+
+    pair_slot_t *slot = get_or_add_slot(store, pair);
+    if (!slot)
+        return false;
+
+    slot->value = value;
+    return true;
+}
+
+bool pair_store_get(const pair_store_t *store, pair_t pair, uint32_t *value)
+{
+    if (!store || !value || pair.a >= store->num_of_rows)
+        return false;
+
+    const pair_row_t *row = &store->rows[pair.a];
+    if (!row->len)
+        return false;
+
+    const pair_slot_t *slot = find_slot(row, pair.b);
+    if (slot->b != pair.b)
+        return false;
+
+    *value = slot->value;
+    return true;
+}
+
+bool pair_store_merge(pair_store_t *dst, const pair_store_t *src)
+{
+    if (!dst || !src)
+        return false;
+
+    for (size_t a = 0; a < src->num_of_rows; a++)
+    {
+        const pair_row_t *row = &src->rows[a];
+        if (!row->len)
+            continue;
+
+        for (size_t i = 0; i <= row->mask; i++)
+        {
+            if (row->slots[i].b != PAIR_STORE_EMPTY &&
+                !pair_store_add(dst, (pair_t){(uint32_t)a, row->slots[i].b}, row->slots[i].value))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+void pair_store_clear(pair_store_t *store)
+{
+    if (!store)
+        return;
+
+    // rows keep their slots, the next round mostly sees the same first symbols again
+    for (size_t a = 0; a < store->num_of_rows; a++)
+    {
+        pair_row_t *row = &store->rows[a];
+        if (!row->len)
+            continue;
+
+        memset(row->slots, 0xff, ((size_t)row->mask + 1) * sizeof(pair_slot_t));
+        row->len = 0;
+    }
+
+    store->num_of_pairs = 0;
+}
+
+size_t pair_store_bytes(const pair_store_t *store)
+{
+    if (!store)
+        return 0;
+
+    size_t bytes = sizeof(pair_store_t) + store->num_of_rows * sizeof(pair_row_t);
+    for (size_t a = 0; a < store->num_of_rows; a++)
+    {
+        if (store->rows[a].slots)
+            bytes += ((size_t)store->rows[a].mask + 1) * sizeof(pair_slot_t);
+    }
+
+    return bytes;
+}
@@ -0,0 +1,168 @@
+#include "../inc/bpe.h"
+
+#define PRUNE_DROPPED UINT32_MAX
+
+// reads a merge from a table of either layout, false unless it only references tokens made before it
+static inline bool get_merge(dyn_arr_t *pair_arr, size_t token, pair_t *pair)
+{
+    if (!dyn_arr_get(pair_arr, token, pair) || pair->a >= token || pair->b >= token)
+    {
+        fprintf(stderr, "Invalid merge at index %zu\n", token);
+        return false;
+    }
+    return true;
+}
+
+bool bpe_prune(dyn_arr_t *pair_arr, const bpe_vocab_stats_t *stats, size_t min_freq, dyn_arr_t **pruned, uint32_t **old_to_new)
+{
+    if (!pair_arr || pair_arr->last_index < 255 || !stats || !stats->token_freq || !pruned || !old_to_new ||
+        stats->num_of_tokens != pair_arr->last_index + 1)
+        return false;
+
+    size_t num_of_tokens = pair_arr->last_index + 1;
+    uint32_t *ids = (uint32_t *)malloc(num_of_tokens * sizeof(uint32_t));
+    bool *needed = (bool *)calloc(num_of_tokens, sizeof(bool));
+    *pruned = dyn_arr_create_contiguous(num_of_tokens, sizeof(pair_t));
+    if (!ids || !needed || !*pruned)
+    {
+        free(ids);
+        free(needed);
+        dyn_arr_free(*pruned);
+        *pruned = NULL;
+        return false;
+    }
+
+    // a pair table can't say a token is three others, so whatever a kept token is built from stays too.
+    // parts always have lower ids, one pass from the top settles every token
+    bool ok = true;
+    for (size_t token = num_of_tokens; ok && token-- > 256;)
+    {
+        pair_t pair;
+        if (!(ok = get_merge(pair_arr, token, &pair)))
+            break;
+
+        bool keep = needed[token] || stats->token_freq[token] >= min_freq;
+        ids[token] = keep ? 0 : PRUNE_DROPPED;
+        if (keep)
+        {
+            needed[pair.a] = true;
+            needed[pair.b] = true;
+        }
+    }
+
+    // kept tokens keep their order, so the merges still apply in the order they were learned
+    uint32_t next_id = 0;
+    for (size_t token = 0; ok && token < num_of_tokens; token++)
+    {
+        if (token >= 256 && ids[token] == PRUNE_DROPPED)
+            continue;
+
+        pair_t pair;
+        if (!(ok = dyn_arr_get(pair_arr, token, &pair)))
+            break;
+        if (token >= 256)
+            pair = (pair_t){ids[pair.a], ids[pair.b]};
+
+        ids[token] = next_id;
+        ok = pair_vec_set(*pruned, next_id++, pair);
+    }
+
+    free(needed);
+    if (!ok)
+    {
+        free(ids);
+        dyn_arr_free(*pruned);
+        *pruned = NULL;
+        return false;
+    }
+
+    *old_to_new = ids;
+    return true;
+}
+
+// writes token's kept parts to out in order, dropped tokens are split into the two they were made from.
+// the table was checked by bpe_prune_rewrite before any token is split
+static size_t split_token(dyn_arr_t *pair_arr, const uint32_t *old_to_new, uint32_t token, uint32_t *out, uint32_t *stack)
+{
+    size_t len = 0, depth = 0;
+    stack[depth++] = token;
+    while (depth)
+    {
+        uint32_t top = stack[--depth];
+        if (old_to_new[top] != PRUNE_DROPPED)
+        {
+            out[len++] = old_to_new[top];
+            continue;
+        }
+
+        // right part first, so the left one comes off the stack next
+        pair_t pair;
+        dyn_arr_get(pair_arr, top, &pair);
+        stack[depth++] = pair.b;
+        stack[depth++] = pair.a;
+    }
+
+    return len;
+}
+
+bool bpe_prune_rewrite(dyn_arr_t *pair_arr, const uint32_t *old_to_new, const uint32_t *tokens, size_t len, uint32_t **out,
+                       size_t *out_len)
+{
+    if (!pair_arr || pair_arr->last_index < 255 || !old_to_new || (!tokens && len) || !out || !out_len)
+        return false;
+
+    // byte lengths bound both how many parts a token splits into and how many the split has pending
+    size_t num_of_tokens = pair_arr->last_index + 1;
+    size_t *token_len = (size_t *)malloc(num_of_tokens * sizeof(size_t));
+    if (!token_len)
+        return false;
+
+    for (size_t token = 0; token < num_of_tokens; token++)
+    {
+        pair_t pair;
+        if (token >= 256 && !get_merge(pair_arr, token, &pair))
+        {
+            free(token_len);
+            return false;
+        }
+        token_len[token] = token < 256 ? 1 : token_len[pair.a] + token_len[pair.b];
+    }
+
+    size_t new_len = 0;
+    size_t max_token_len = 1;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (tokens[i] >= num_of_tokens)
+        {
+            free(token_len);
+            return false;
+        }
+        new_len += old_to_new[tokens[i]] != PRUNE_DROPPED ? 1 : token_len[tokens[i]];
+        max_token_len = token_len[tokens[i]] > max_token_len ? token_len[tokens[i]] : max_token_len;
+    }
+    free(token_len);
+
+    *out = (uint32_t *)malloc((new_len ? new_len : 1) * sizeof(uint32_t));
+    uint32_t *stack = (uint32_t *)malloc((max_token_len + 1) * sizeof(uint32_t));
+    if (!*out || !stack)
+    {
+        free(*out);
+        free(stack);
+        *out = NULL;
+        return false;
+    }
+
+    size_t pos = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        uint32_t id = old_to_new[tokens[i]];
+        if (id != PRUNE_DROPPED)
+            (*out)[pos++] = id;
+        else
+            pos += split_token(pair_arr, old_to_new, tokens[i], *out + pos, stack);
+    }
+
+    free(stack);
+    *out_len = pos;
+    return true;
+}
@@ -0,0 +1,311 @@
+#include "../inc/bpe.h"
+
+// the state lives in [RANS_L, RANS_L << 32) between symbols and is renormalized 32 bits at a time
+#define RANS_L (1ULL << 31)
+#define RANS_MIN_PROB_BITS 12
+#define RANS_MAX_PROB_BITS 20
+// probability bits on top of what it takes to give every symbol one slot, so rare tokens aren't squeezed
+#define RANS_PROB_HEADROOM 6
+#define VARINT_MAX_LEN 10
+
+// coded stream layout: this header, num_of_symbols (symbol gap, frequency) varint pairs, the final encoder
+// state as two uint32_t words, then the renormalization words in the order the decoder reads them. host
+// byte order like the checkpoints
+typedef struct
+{
+    uint64_t num_of_tokens;
+    uint32_t num_of_symbols;
+    uint8_t prob_bits;
+    uint8_t reserved[3];
+} rans_header_t;
+
+typedef struct
+{
+    uint32_t symbol;
+    uint32_t freq; // quantized, the symbol's share of 1 << prob_bits
+    uint32_t cum;  // sum of the frequencies before it
+} rans_symbol_t;
+
+static inline size_t put_varint(uint8_t *out, uint64_t value)
+{
+    size_t len = 0;
+    while (value >= 0x80)
+    {
+        out[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
+
+static inline bool get_varint(const uint8_t *buf, size_t len, size_t *pos, uint64_t *value)
+{
+    *value = 0;
+    for (unsigned shift = 0; *pos < len && shift < 64; shift += 7)
+    {
+        uint8_t byte = buf[(*pos)++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static int freq_desc_cmp(const void *a, const void *b)
+{
+    uint32_t one = ((const rans_symbol_t *)a)->freq;
+    uint32_t two = ((const rans_symbol_t *)b)->freq;
+    return (one < two) - (one > two);
+}
+
+static int symbol_cmp(const void *a, const void *b)
+{
+    uint32_t one = ((const rans_symbol_t *)a)->symbol;
+    uint32_t two = ((const rans_symbol_t *)b)->symbol;
+    return (one > two) - (one < two);
+}
+
+// scales the counts (held in freq) to sum to 1 << prob_bits, keeping every symbol at least 1
+static void quantize(rans_symbol_t *symbols, size_t num_of_symbols, size_t total, uint8_t prob_bits)
+{
+    uint64_t scale = 1ULL << prob_bits;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < num_of_symbols; i++)
+    {
+        uint64_t freq = symbols[i].freq * scale / total;
+        symbols[i].freq = (uint32_t)(freq ? freq : 1);
+        sum += symbols[i].freq;
+    }
+
+    // rounding down leaves slots over, they go to the most frequent symbol where they cost the least; symbols
+    // raised to 1 can overshoot instead, that is taken back a slot at a time from the largest ones
+    qsort(symbols, num_of_symbols, sizeof(rans_symbol_t), freq_desc_cmp);
+    if (sum < scale)
+        symbols[0].freq += (uint32_t)(scale - sum);
+
+    while (sum > scale)
+    {
+        for (size_t i = 0; i < num_of_symbols && sum > scale && symbols[i].freq > 1; i++)
+        {
+            symbols[i].freq--;
+            sum--;
+        }
+    }
+
+    qsort(symbols, num_of_symbols, sizeof(rans_symbol_t), symbol_cmp);
+    uint32_t cum = 0;
+    for (size_t i = 0; i < num_of_symbols; i++)
+    {
+        symbols[i].cum = cum;
+        cum += symbols[i].freq;
+    }
+}
+
+bool bpe_rans_encode(const uint32_t *tokens, size_t len, size_t vocab_size, uint8_t **out, size_t *out_len)
+{
+    if ((!tokens && len) || !vocab_size || vocab_size > UINT32_MAX || !out || !out_len)
+        return false;
+
+    uint32_t *index = (uint32_t *)malloc(vocab_size * sizeof(uint32_t)); // token -> entry in symbols
+    size_t *counts = (size_t *)calloc(vocab_size, sizeof(size_t));
+    if (!index || !counts)
+    {
+        free(index);
+        free(counts);
+        return false;
+    }
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (tokens[i] >= vocab_size)
+        {
+            fprintf(stderr, "Token %u at %zu is outside the vocabulary\n", tokens[i], i);
+            free(index);
+            free(counts);
+            return false;
+        }
+        counts[tokens[i]]++;
+    }
+
+    size_t num_of_symbols = 0;
+    for (size_t i = 0; i < vocab_size; i++)
+        num_of_symbols += counts[i] != 0;
+
+    uint8_t needed_bits = 0;
+    while (((size_t)1 << needed_bits) < num_of_symbols)
+        needed_bits++;
+    if (needed_bits > 31)
+    {
+        free(index);
+        free(counts);
+        return false;
+    }
+
+    // past the cap the decoder's slot table stops fitting in cache, only a vocabulary that big goes further
+    uint8_t prob_bits = needed_bits + RANS_PROB_HEADROOM;
+    prob_bits = prob_bits < RANS_MIN_PROB_BITS ? RANS_MIN_PROB_BITS : prob_bits > RANS_MAX_PROB_BITS ? RANS_MAX_PROB_BITS : prob_bits;
+    prob_bits = prob_bits < needed_bits ? needed_bits : prob_bits;
+
+    rans_symbol_t *symbols = (rans_symbol_t *)malloc((num_of_symbols ? num_of_symbols : 1) * sizeof(rans_symbol_t));
+    // every token renormalizes at most once, so it writes at most one word
+    size_t cap = sizeof(rans_header_t) + num_of_symbols * 2 * VARINT_MAX_LEN + (len + 2) * sizeof(uint32_t);
+    uint8_t *buf = (uint8_t *)malloc(cap);
+    if (!symbols || !buf)
+    {
+        free(symbols);
+        free(buf);
+        free(index);
+        free(counts);
+        return false;
+    }
+
+    for (size_t i = 0, j = 0; i < vocab_size; i++)
+    {
+        if (counts[i])
+            symbols[j++] = (rans_symbol_t){(uint32_t)i, (uint32_t)(counts[i] < UINT32_MAX ? counts[i] : UINT32_MAX), 0};
+    }
+    if (num_of_symbols)
+        quantize(symbols, num_of_symbols, len, prob_bits);
+    for (size_t i = 0; i < num_of_symbols; i++)
+        index[symbols[i].symbol] = (uint32_t)i;
+
+    rans_header_t header = {.num_of_tokens = len, .num_of_symbols = (uint32_t)num_of_symbols, .prob_bits = prob_bits};
+    memcpy(buf, &header, sizeof(header));
+    size_t pos = sizeof(header);
+    uint32_t next_symbol = 0;
+    for (size_t i = 0; i < num_of_symbols; i++)
+    {
+        pos += put_varint(buf + pos, symbols[i].symbol - next_symbol);
+        pos += put_varint(buf + pos, symbols[i].freq);
+        next_symbol = symbols[i].symbol + 1;
+    }
+
+    // rans is last in first out, so the tokens are coded back to front, filling a scratch array from its end,
+    // and the words copied behind the table afterwards
+    uint32_t *words_end = (uint32_t *)malloc((len + 2) * sizeof(uint32_t));
+    if (!words_end)
+    {
+        free(symbols);
+        free(buf);
+        free(index);
+        free(counts);
+        return false;
+    }
+
+    uint32_t *word = words_end + len + 2;
+    uint64_t x = RANS_L;
+    for (size_t i = len; i-- > 0;)
+    {
+        const rans_symbol_t *sym = &symbols[index[tokens[i]]];
+        uint64_t x_max = ((RANS_L >> prob_bits) << 32) * sym->freq;
+        if (x >= x_max)
+        {
+            *--word = (uint32_t)x;
+            x >>= 32;
+        }
+        x = ((x / sym->freq) << prob_bits) + (x % sym->freq) + sym->cum;
+    }
+    *--word = (uint32_t)(x >> 32);
+    *--word = (uint32_t)x;
+
+    size_t words_len = (size_t)(words_end + len + 2 - word);
+    memcpy(buf + pos, word, words_len * sizeof(uint32_t));
+    pos += words_len * sizeof(uint32_t);
+
+    free(words_end);
+    free(symbols);
+    free(index);
+    free(counts);
+
+    *out = buf;
+    *out_len = pos;
+    return true;
+}
+
+bool bpe_rans_decode(const uint8_t *buf, size_t buf_len, uint32_t **tokens, size_t *len)
+{
+    if (!buf || !tokens || !len)
+        return false;
+
+    rans_header_t header;
+    if (buf_len < sizeof(header))
+        return false;
+    memcpy(&header, buf, sizeof(header));
+    if (header.prob_bits < 1 || header.prob_bits > 31 || header.num_of_tokens > SIZE_MAX / sizeof(uint32_t) ||
+        (header.num_of_tokens && !header.num_of_symbols) || header.num_of_symbols > ((uint64_t)1 << header.prob_bits))
+        return false;
+
+    uint32_t mask = (uint32_t)((1ULL << header.prob_bits) - 1);
+    rans_symbol_t *symbols = (rans_symbol_t *)malloc((header.num_of_symbols ? header.num_of_symbols : 1) * sizeof(rans_symbol_t));
+    // slot -> entry in symbols, one lookup per token
+    uint32_t *slots = (uint32_t *)malloc(((size_t)mask + 1) * sizeof(uint32_t));
+    *tokens = (uint32_t *)malloc((header.num_of_tokens ? header.num_of_tokens : 1) * sizeof(uint32_t));
+    bool ok = symbols && slots && *tokens;
+
+    size_t pos = sizeof(header);
+    uint64_t next_symbol = 0, cum = 0;
+    for (uint32_t i = 0; ok && i < header.num_of_symbols; i++)
+    {
+        uint64_t gap, freq;
+        ok = get_varint(buf, buf_len, &pos, &gap) && get_varint(buf, buf_len, &pos, &freq) && freq &&
+             next_symbol + gap < UINT32_MAX && cum + freq <= (uint64_t)mask + 1;
+        if (!ok)
+            break;
+
+        symbols[i] = (rans_symbol_t){(uint32_t)(next_symbol + gap), (uint32_t)freq, (uint32_t)cum};
+        for (uint64_t slot = cum; slot < cum + freq; slot++)
+            slots[slot] = i;
+        next_symbol += gap + 1;
+        cum += freq;
+    }
+    ok = ok && (!header.num_of_symbols || cum == (uint64_t)mask + 1);
+
+    const uint8_t *words = buf + pos;
+    size_t words_len = ok ? (buf_len - pos) / sizeof(uint32_t) : 0;
+    ok = ok && words_len >= 2;
+
+    uint64_t x = 0;
+    size_t word = 2;
+    if (ok)
+    {
+        uint32_t low, high;
+        memcpy(&low, words, sizeof(uint32_t));
+        memcpy(&high, words + sizeof(uint32_t), sizeof(uint32_t));
+        x = ((uint64_t)high << 32) | low;
+    }
+
+    for (size_t i = 0; ok && i < header.num_of_tokens; i++)
+    {
+        uint32_t slot = (uint32_t)x & mask;
+        const rans_symbol_t *sym = &symbols[slots[slot]];
+        (*tokens)[i] = sym->symbol;
+        x = sym->freq * (x >> header.prob_bits) + slot - sym->cum;
+        if (x < RANS_L)
+        {
+            if (word >= words_len)
+            {
+                ok = false;
+                break;
+            }
+
+            uint32_t next;
+            memcpy(&next, words + word++ * sizeof(uint32_t), sizeof(uint32_t));
+            x = (x << 32) | next;
+        }
+    }
+
+    // the decoder ends in the state the encoder started from, with every word used
+    ok = ok && x == RANS_L && word == words_len;
+
+    free(symbols);
+    free(slots);
+    if (!ok)
+    {
+        free(*tokens);
+        *tokens = NULL;
+        return false;
+    }
+
+    *len = header.num_of_tokens;
+    return true;
+}
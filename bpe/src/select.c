@@ -0,0 +1,81 @@
+#include "../inc/bpe.h"
+
+#define NOT_IN_BATCH UINT32_MAX
+
+bool pair_freq_less(const void *a, const void *b)
+{
+    const pair_freq_t *one = (const pair_freq_t *)a;
+    const pair_freq_t *two = (const pair_freq_t *)b;
+    if (one->freq != two->freq)
+        return one->freq < two->freq;
+
+    // the higher pair ranks lower, so ties go to the lowest pair whatever order the counts were read in
+    return one->pair.a != two->pair.a ? one->pair.a > two->pair.a : one->pair.b > two->pair.b;
+}
+
+// with min_ratio == 0 the batch ends at the first candidate one-at-a-time training could order differently:
+// one sharing a symbol with an accepted pair (its count changes once that pair merges), or one that a pair
+// created by the batch might outcount. with min_ratio > 0 conflicting candidates are skipped instead and
+// anything counted at least min_ratio times the best pair is accepted
+void bpe_select_batch(const pair_freq_t *nodes, size_t len, size_t k, double min_ratio, uint32_t symbol_limit, pair_freq_t *cands,
+                      uint32_t *symbol_info, pair_freq_t *batch, size_t *batch_len)
+{
+    *batch_len = 0;
+    if (!len || !k)
+        return;
+
+    size_t cand_cap = k * BPE_BATCH_CANDIDATE_FACTOR;
+    dyn_arr_t view = {.item_size = sizeof(pair_freq_t), .contiguous = true, .data = (void *)nodes, .capacity = len, .last_index = len - 1};
+
+    // per symbol: largest count of a pair starting with it, largest count of a pair ending with it, batch use
+    uint32_t *start_max = symbol_info;
+    uint32_t *end_max = symbol_info + symbol_limit;
+    uint32_t *in_batch = symbol_info + 2 * (size_t)symbol_limit;
+    memset(symbol_info, 0, 2 * (size_t)symbol_limit * sizeof(uint32_t));
+    memset(in_batch, 0xff, (size_t)symbol_limit * sizeof(uint32_t));
+
+    if (min_ratio <= 0)
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            if (nodes[i].freq > start_max[nodes[i].pair.a])
+                start_max[nodes[i].pair.a] = nodes[i].freq;
+            if (nodes[i].freq > end_max[nodes[i].pair.b])
+                end_max[nodes[i].pair.b] = nodes[i].freq;
+        }
+    }
+
+    size_t found;
+    dyn_arr_topk(&view, 0, len - 1, cand_cap, pair_freq_less, cands, &found);
+
+    uint32_t new_pair_bound = 0;
+    for (size_t i = 0; i < found && *batch_len < k; i++)
+    {
+        pair_freq_t cand = cands[i];
+        if (cand.freq <= 1)
+            break;
+
+        bool conflict = in_batch[cand.pair.a] != NOT_IN_BATCH || in_batch[cand.pair.b] != NOT_IN_BATCH;
+        if (min_ratio <= 0)
+        {
+            if (*batch_len && (conflict || cand.freq < new_pair_bound))
+                break;
+        }
+        else
+        {
+            if (cand.freq < min_ratio * cands[0].freq)
+                break;
+            if (conflict)
+                continue;
+        }
+
+        in_batch[cand.pair.a] = (uint32_t)*batch_len;
+        in_batch[cand.pair.b] = (uint32_t)*batch_len;
+        batch[(*batch_len)++] = cand;
+
+        // pairs with the new symbol come from x a b or a b y, so they can't outcount (x, a), (b, y) or the pair itself
+        uint32_t bound = end_max[cand.pair.a] > start_max[cand.pair.b] ? end_max[cand.pair.a] : start_max[cand.pair.b];
+        bound = bound < cand.freq ? bound : cand.freq;
+        new_pair_bound = bound > new_pair_bound ? bound : new_pair_bound;
+    }
+}
@@ -0,0 +1,710 @@
+#include "../inc/bpe.h"
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// a varint of a 64 bit value takes at most this many bytes
+#define VARINT_MAX_LEN 10
+// bounds what a message header can claim, the buffer grows only as the payload actually comes in
+#define SHARD_MAX_MSG_LEN ((uint64_t)1 << 36)
+#define SHARD_MSG_CHUNK (64 * 1024)
+
+typedef enum
+{
+    SHARD_MSG_COUNTS = 1, // shard -> coordinator: change in the shard's pair counts since the last round
+    SHARD_MSG_MERGES,     // coordinator -> shard: uint32_t first new symbol, then the round's pair_t merges
+    SHARD_MSG_STOP,       // coordinator -> shard: no more merges, send the text back
+    SHARD_MSG_TEXT,       // shard -> coordinator: the shard's final uint32_t symbols
+} shard_msg_t;
+
+// every message is this header and len payload bytes, in host byte order like the checkpoints
+typedef struct
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t len;
+} shard_msg_header_t;
+
+typedef struct
+{
+    uint32_t b;
+    int64_t delta;
+} row_entry_t;
+
+static inline size_t put_varint(uint8_t *out, uint64_t value)
+{
+    size_t len = 0;
+    while (value >= 0x80)
+    {
+        out[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
+
+static inline bool get_varint(const uint8_t *buf, size_t len, size_t *pos, uint64_t *value)
+{
+    *value = 0;
+    for (unsigned shift = 0; *pos < len && shift < 64; shift += 7)
+    {
+        uint8_t byte = buf[(*pos)++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// zigzag, so small negative deltas stay short
+static inline uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static int row_entry_cmp(const void *a, const void *b)
+{
+    uint32_t b_one = ((const row_entry_t *)a)->b;
+    uint32_t b_two = ((const row_entry_t *)b)->b;
+    return (b_one > b_two) - (b_one < b_two);
+}
+
+bool bpe_counts_pack(const pair_store_t *store, const pair_store_t *prev, uint8_t **buf, size_t *len)
+{
+    if (!store || !buf || !len)
+        return false;
+
+    size_t num_of_rows = store->num_of_rows;
+    size_t num_of_pairs = store->num_of_pairs;
+    size_t max_row = 0;
+    if (prev)
+    {
+        num_of_rows = prev->num_of_rows > num_of_rows ? prev->num_of_rows : num_of_rows;
+        num_of_pairs += prev->num_of_pairs;
+    }
+
+    for (size_t a = 0; a < num_of_rows; a++)
+    {
+        size_t row_len = a < store->num_of_rows ? store->rows[a].len : 0;
+        if (prev && a < prev->num_of_rows)
+            row_len += prev->rows[a].len;
+        max_row = row_len > max_row ? row_len : max_row;
+    }
+
+    // a row header is two varints, an entry a b gap and a value
+    *buf = (uint8_t *)malloc(num_of_pairs * 3 * VARINT_MAX_LEN + 1);
+    row_entry_t *entries = (row_entry_t *)malloc((max_row ? max_row : 1) * sizeof(row_entry_t));
+    if (!*buf || !entries)
+    {
+        free(*buf);
+        free(entries);
+        *buf = NULL;
+        return false;
+    }
+
+    size_t pos = 0;
+    size_t next_a = 0;
+    for (size_t a = 0; a < num_of_rows; a++)
+    {
+        const pair_row_t *row = a < store->num_of_rows ? &store->rows[a] : NULL;
+        const pair_row_t *prev_row = prev && a < prev->num_of_rows ? &prev->rows[a] : NULL;
+        size_t row_len = 0;
+
+        for (size_t i = 0; row && row->len && i <= row->mask; i++)
+        {
+            if (row->slots[i].b == PAIR_STORE_EMPTY)
+                continue;
+
+            uint32_t old = 0;
+            if (prev_row && prev_row->len)
+                pair_store_get(prev, (pair_t){(uint32_t)a, row->slots[i].b}, &old);
+            if (row->slots[i].value != old)
+                entries[row_len++] = (row_entry_t){row->slots[i].b, (int64_t)row->slots[i].value - old};
+        }
+
+        // pairs gone since the previous table are sent as minus their old count
+        for (size_t i = 0; prev_row && prev_row->len && i <= prev_row->mask; i++)
+        {
+            uint32_t value;
+            if (prev_row->slots[i].b != PAIR_STORE_EMPTY && prev_row->slots[i].value &&
+                !pair_store_get(store, (pair_t){(uint32_t)a, prev_row->slots[i].b}, &value))
+            {
+                entries[row_len++] = (row_entry_t){prev_row->slots[i].b, -(int64_t)prev_row->slots[i].value};
+            }
+        }
+
+        if (!row_len)
+            continue;
+
+        // rows go out in ascending a and entries in ascending b, so both are written as gaps from the last one
+        qsort(entries, row_len, sizeof(row_entry_t), row_entry_cmp);
+        pos += put_varint(*buf + pos, a - next_a);
+        pos += put_varint(*buf + pos, row_len);
+        next_a = a + 1;
+
+        uint32_t next_b = 0;
+        for (size_t i = 0; i < row_len; i++)
+        {
+            pos += put_varint(*buf + pos, entries[i].b - next_b);
+            pos += put_varint(*buf + pos, zigzag(entries[i].delta));
+            next_b = entries[i].b + 1;
+        }
+    }
+
+    free(entries);
+    *len = pos;
+    return true;
+}
+
+bool bpe_counts_unpack(const uint8_t *buf, size_t len, uint32_t symbol_limit, pair_store_t *store)
+{
+    if ((!buf && len) || !store)
+        return false;
+
+    size_t pos = 0;
+    uint64_t next_a = 0;
+    while (pos < len)
+    {
+        uint64_t a_gap, row_len;
+        if (!get_varint(buf, len, &pos, &a_gap) || !get_varint(buf, len, &pos, &row_len) ||
+            next_a >= symbol_limit || a_gap >= symbol_limit - next_a)
+            return false;
+
+        uint64_t a = next_a + a_gap;
+        next_a = a + 1;
+
+        uint64_t next_b = 0;
+        for (uint64_t i = 0; i < row_len; i++)
+        {
+            uint64_t b_gap, value;
+            if (!get_varint(buf, len, &pos, &b_gap) || !get_varint(buf, len, &pos, &value) ||
+                next_b >= symbol_limit || b_gap >= symbol_limit - next_b)
+                return false;
+
+            uint64_t b = next_b + b_gap;
+            next_b = b + 1;
+
+            // counts are uint32_t, a negative delta wraps around to the subtraction
+            if (!pair_store_add(store, (pair_t){(uint32_t)a, (uint32_t)b}, (uint32_t)unzigzag(value)))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static bool write_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *pos = (const uint8_t *)data;
+    while (len)
+    {
+        // a shard that died must fail the write, not kill the coordinator with SIGPIPE
+        ssize_t written = send(fd, pos, len, MSG_NOSIGNAL);
+        if (written < 0 && errno == ENOTSOCK)
+            written = write(fd, pos, len);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+
+        pos += written;
+        len -= (size_t)written;
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, void *data, size_t len)
+{
+    uint8_t *pos = (uint8_t *)data;
+    while (len)
+    {
+        ssize_t got = read(fd, pos, len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+
+        pos += got;
+        len -= (size_t)got;
+    }
+
+    return true;
+}
+
+static bool send_msg(int fd, shard_msg_t type, const void *payload, size_t len)
+{
+    shard_msg_header_t header = {.type = type, .len = len};
+    return write_all(fd, &header, sizeof(header)) && write_all(fd, payload, len);
+}
+
+// reads a message into *buf, growing it as needed. the header's length isn't trusted up front, so a peer has
+// to actually send the bytes it claims before they are allocated
+static bool recv_msg(int fd, shard_msg_t *type, uint8_t **buf, size_t *cap, size_t *len)
+{
+    shard_msg_header_t header;
+    if (!read_all(fd, &header, sizeof(header)) || header.len > SHARD_MAX_MSG_LEN || header.len > SIZE_MAX)
+        return false;
+
+    size_t got = 0;
+    while (got < header.len)
+    {
+        if (got == *cap)
+        {
+            size_t grow = *cap > SHARD_MSG_CHUNK ? *cap : SHARD_MSG_CHUNK;
+            size_t new_cap = header.len - *cap < grow ? header.len : *cap + grow;
+            uint8_t *grown = (uint8_t *)realloc(*buf, new_cap);
+            if (!grown)
+                return false;
+            *buf = grown;
+            *cap = new_cap;
+        }
+
+        size_t chunk = (header.len < *cap ? header.len : *cap) - got;
+        if (!read_all(fd, *buf + got, chunk))
+            return false;
+        got += chunk;
+    }
+
+    *type = (shard_msg_t)header.type;
+    *len = header.len;
+    return true;
+}
+
+static bool count_text(pair_store_t *store, const uint32_t *text, size_t len)
+{
+    for (size_t i = 0; i + 1 < len; i++)
+    {
+        if (!pair_store_add(store, (pair_t){text[i], text[i + 1]}, 1))
+            return false;
+    }
+    return true;
+}
+
+// the round's merges share no symbols, so applying them one after the other gives the same text as one pass
+static size_t apply_merge(uint32_t *text, size_t len, pair_t pair, uint32_t symbol)
+{
+    size_t out = 0;
+    for (size_t i = 0; i < len;)
+    {
+        if (i + 1 < len && text[i] == pair.a && text[i + 1] == pair.b)
+        {
+            text[out++] = symbol;
+            i += 2;
+        }
+        else
+        {
+            text[out++] = text[i++];
+        }
+    }
+
+    return out;
+}
+
+bool bpe_shard_serve(int fd, const uint8_t *bytes, size_t len)
+{
+    uint32_t *text = (uint32_t *)malloc((len ? len : 1) * sizeof(uint32_t));
+    pair_store_t *counts = pair_store_create(512);
+    pair_store_t *prev = pair_store_create(512);
+    uint8_t *msg = NULL;
+    size_t msg_cap = 0, msg_len;
+    bool ok = false;
+    if (!text || !counts || !prev)
+        goto cleanup;
+
+    for (size_t i = 0; i < len; i++)
+        text[i] = bytes[i];
+
+    size_t text_size = len;
+    while (true)
+    {
+        // only the change since the last round goes out, most of the table stays the same from round to round
+        pair_store_clear(counts);
+        if (!count_text(counts, text, text_size))
+            goto cleanup;
+
+        uint8_t *packed;
+        size_t packed_len;
+        if (!bpe_counts_pack(counts, prev, &packed, &packed_len))
+            goto cleanup;
+        bool sent = send_msg(fd, SHARD_MSG_COUNTS, packed, packed_len);
+        free(packed);
+        if (!sent)
+            goto cleanup;
+
+        pair_store_t *swap = prev;
+        prev = counts;
+        counts = swap;
+
+        shard_msg_t type;
+        if (!recv_msg(fd, &type, &msg, &msg_cap, &msg_len))
+            goto cleanup;
+
+        if (type == SHARD_MSG_STOP)
+        {
+            ok = send_msg(fd, SHARD_MSG_TEXT, text, text_size * sizeof(uint32_t));
+            break;
+        }
+
+        if (type != SHARD_MSG_MERGES || msg_len < sizeof(uint32_t) || (msg_len - sizeof(uint32_t)) % sizeof(pair_t))
+            goto cleanup;
+
+        uint32_t symbol;
+        memcpy(&symbol, msg, sizeof(uint32_t));
+        for (size_t offset = sizeof(uint32_t); offset < msg_len; offset += sizeof(pair_t))
+        {
+            pair_t pair;
+            memcpy(&pair, msg + offset, sizeof(pair_t));
+            text_size = apply_merge(text, text_size, pair, symbol++);
+        }
+    }
+
+cleanup:
+    free(msg);
+    pair_store_free(counts);
+    pair_store_free(prev);
+    free(text);
+    return ok;
+}
+
+// lists the summed counts for bpe_select_batch, growing nodes as needed, and sums them into total
+static bool flatten_counts(const pair_store_t *counts, pair_freq_t **nodes, size_t *nodes_cap, size_t *len, size_t *total)
+{
+    *len = 0;
+    *total = 0;
+    for (size_t a = 0; a < counts->num_of_rows; a++)
+    {
+        const pair_row_t *row = &counts->rows[a];
+        for (size_t i = 0; row->len && i <= row->mask; i++)
+        {
+            uint32_t freq = row->slots[i].value;
+            if (row->slots[i].b == PAIR_STORE_EMPTY || !freq)
+                continue;
+
+            if (*len == *nodes_cap)
+            {
+                size_t cap = *nodes_cap ? *nodes_cap * 2 : 4096;
+                pair_freq_t *grown = (pair_freq_t *)realloc(*nodes, cap * sizeof(pair_freq_t));
+                if (!grown)
+                    return false;
+                *nodes = grown;
+                *nodes_cap = cap;
+            }
+            (*nodes)[(*len)++] = (pair_freq_t){{(uint32_t)a, row->slots[i].b}, freq};
+            *total += freq;
+        }
+    }
+    return true;
+}
+
+static double shard_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+dyn_arr_t *bpe_shard_coordinate(const int *fds, size_t num_of_shards, uint32_t **encoding, size_t *len, const bpe_train_opts_t *opts,
+                                bpe_train_stats_t *stats)
+{
+    if (!fds || !num_of_shards || !encoding || !len)
+        return NULL;
+
+    double start_time = shard_now();
+    size_t max_merges = opts ? opts->max_merges : 0;
+    size_t merges_per_round = opts && opts->merges_per_round ? opts->merges_per_round : 1;
+    double batch_min_ratio = opts ? opts->batch_min_ratio : 0;
+    bpe_progress_cb progress = opts ? opts->progress : NULL;
+    size_t progress_every = opts && opts->progress_every ? opts->progress_every : 1;
+    void *progress_user = opts ? opts->progress_user : NULL;
+    bpe_vocab_stats_t *vocab_stats = opts ? opts->vocab_stats : NULL;
+    if (vocab_stats)
+        memset(vocab_stats, 0, sizeof(bpe_vocab_stats_t));
+
+    bpe_train_stats_t run_stats;
+    memset(&run_stats, 0, sizeof(run_stats));
+    run_stats.shards = num_of_shards;
+
+    dyn_arr_t *pair_arr = dyn_arr_create_contiguous(512, sizeof(pair_t));
+    pair_store_t *counts = pair_store_create(512);
+    pair_freq_t *cands = (pair_freq_t *)malloc(merges_per_round * BPE_BATCH_CANDIDATE_FACTOR * sizeof(pair_freq_t));
+    pair_freq_t *batch = (pair_freq_t *)malloc(merges_per_round * sizeof(pair_freq_t));
+    // the merges message, the first new symbol and then the pairs
+    uint8_t *merges_msg = (uint8_t *)malloc(sizeof(uint32_t) + merges_per_round * sizeof(pair_t));
+    uint32_t *symbol_info = NULL;
+    size_t symbol_cap = 0;
+    pair_freq_t *nodes = NULL;
+    size_t nodes_cap = 0;
+    uint8_t *msg = NULL;
+    size_t msg_cap = 0, msg_len;
+    *encoding = NULL;
+    if (!pair_arr || !counts || !cands || !batch || !merges_msg)
+        goto error_handling;
+
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        if (!pair_vec_set(pair_arr, i, (pair_t){i, 0}))
+            goto error_handling;
+    }
+
+    uint32_t next_symbol = 256;
+    for (size_t iteration = 0;; iteration++)
+    {
+        // the shards count at the same time, the coordinator only waits for the slowest one
+        for (size_t shard = 0; shard < num_of_shards; shard++)
+        {
+            shard_msg_t type;
+            if (!recv_msg(fds[shard], &type, &msg, &msg_cap, &msg_len) || type != SHARD_MSG_COUNTS ||
+                !bpe_counts_unpack(msg, msg_len, next_symbol, counts))
+            {
+                fprintf(stderr, "Shard %zu sent no counts\n", shard);
+                goto error_handling;
+            }
+            run_stats.shard_bytes += sizeof(shard_msg_header_t) + msg_len;
+        }
+
+        size_t count_table_bytes = pair_store_bytes(counts);
+        if (count_table_bytes > run_stats.count_table_bytes)
+            run_stats.count_table_bytes = count_table_bytes;
+
+        if (max_merges && next_symbol - 256 >= max_merges)
+            break;
+
+        size_t round_limit = merges_per_round;
+        if (max_merges && max_merges - (next_symbol - 256) < round_limit)
+            round_limit = max_merges - (next_symbol - 256);
+
+        if (next_symbol + round_limit > symbol_cap)
+        {
+            size_t cap = symbol_cap * 2 > next_symbol + round_limit ? symbol_cap * 2 : next_symbol + round_limit;
+            uint32_t *grown = (uint32_t *)realloc(symbol_info, 3 * cap * sizeof(uint32_t));
+            if (!grown)
+                goto error_handling;
+            symbol_info = grown;
+            symbol_cap = cap;
+        }
+
+        size_t total, batch_len;
+        if (!flatten_counts(counts, &nodes, &nodes_cap, &run_stats.distinct_pairs, &total))
+            goto error_handling;
+        // the same selection as local training, so both pick the same merges from the same counts
+        bpe_select_batch(nodes, run_stats.distinct_pairs, round_limit, batch_min_ratio, next_symbol, cands, symbol_info, batch,
+                         &batch_len);
+        // every symbol but the last of a shard starts one counted pair
+        if (!iteration)
+            run_stats.input_bytes = total + num_of_shards;
+        if (!batch_len)
+            break;
+
+        memcpy(merges_msg, &next_symbol, sizeof(uint32_t));
+        for (size_t i = 0; i < batch_len; i++)
+        {
+            if (!pair_vec_set(pair_arr, next_symbol + i, batch[i].pair) ||
+                (vocab_stats && !bpe_vocab_stats_record_merge(vocab_stats, next_symbol + i, batch[i].freq)))
+                goto error_handling;
+            memcpy(merges_msg + sizeof(uint32_t) + i * sizeof(pair_t), &batch[i].pair, sizeof(pair_t));
+        }
+
+        for (size_t shard = 0; shard < num_of_shards; shard++)
+        {
+            if (!send_msg(fds[shard], SHARD_MSG_MERGES, merges_msg, sizeof(uint32_t) + batch_len * sizeof(pair_t)))
+            {
+                fprintf(stderr, "Shard %zu is gone\n", shard);
+                goto error_handling;
+            }
+        }
+
+        next_symbol += (uint32_t)batch_len;
+        run_stats.merges += batch_len;
+        run_stats.iterations = iteration + 1;
+
+        if (progress && !(iteration % progress_every))
+        {
+            // a merge takes out about one symbol per occurrence
+            size_t merged = 0;
+            for (size_t i = 0; i < batch_len; i++)
+                merged += batch[i].freq;
+
+            bpe_train_progress_t snapshot = {
+                .iteration = iteration,
+                .merges = next_symbol - 256,
+                .distinct_pairs = run_stats.distinct_pairs,
+                .best = batch[0],
+                .text_size = total + num_of_shards - merged,
+                .input_bytes = run_stats.input_bytes,
+                .elapsed = shard_now() - start_time,
+            };
+            if (!progress(&snapshot, progress_user))
+            {
+                // the shards have the merges already, their next counts are read and dropped
+                for (size_t shard = 0; shard < num_of_shards; shard++)
+                {
+                    shard_msg_t type;
+                    if (!recv_msg(fds[shard], &type, &msg, &msg_cap, &msg_len) || type != SHARD_MSG_COUNTS)
+                        goto error_handling;
+                }
+                break;
+            }
+        }
+    }
+
+    size_t encoding_len = 0;
+    for (size_t shard = 0; shard < num_of_shards; shard++)
+    {
+        shard_msg_t type;
+        if (!send_msg(fds[shard], SHARD_MSG_STOP, NULL, 0) || !recv_msg(fds[shard], &type, &msg, &msg_cap, &msg_len) ||
+            type != SHARD_MSG_TEXT || msg_len % sizeof(uint32_t))
+        {
+            fprintf(stderr, "Shard %zu sent no text\n", shard);
+            goto error_handling;
+        }
+
+        for (size_t offset = 0; offset < msg_len; offset += sizeof(uint32_t))
+        {
+            uint32_t symbol;
+            memcpy(&symbol, msg + offset, sizeof(uint32_t));
+            if (symbol >= next_symbol)
+            {
+                fprintf(stderr, "Shard %zu sent a symbol that was never merged\n", shard);
+                goto error_handling;
+            }
+        }
+
+        size_t bytes = encoding_len * sizeof(uint32_t) + msg_len;
+        uint32_t *grown = (uint32_t *)realloc(*encoding, bytes ? bytes : 1);
+        if (!grown)
+            goto error_handling;
+        *encoding = grown;
+        memcpy(*encoding + encoding_len, msg, msg_len);
+        encoding_len += msg_len / sizeof(uint32_t);
+    }
+
+    if (vocab_stats && !bpe_vocab_stats_count_tokens(vocab_stats, next_symbol, *encoding, encoding_len))
+        goto error_handling;
+
+    *len = encoding_len;
+    run_stats.output_len = encoding_len;
+    run_stats.total_time = shard_now() - start_time;
+    if (stats)
+        *stats = run_stats;
+
+    free(msg);
+    free(nodes);
+    free(symbol_info);
+    free(merges_msg);
+    free(batch);
+    free(cands);
+    pair_store_free(counts);
+    return pair_arr;
+
+error_handling:
+    bpe_vocab_stats_free(vocab_stats);
+    free(*encoding);
+    *encoding = NULL;
+    free(msg);
+    free(nodes);
+    free(symbol_info);
+    free(merges_msg);
+    free(batch);
+    free(cands);
+    pair_store_free(counts);
+    dyn_arr_free(pair_arr);
+    return NULL;
+}
+
+dyn_arr_t *compress_sharded(const char *path, size_t num_of_shards, uint32_t **encoding, size_t *len, const bpe_train_opts_t *opts,
+                            bpe_train_stats_t *stats)
+{
+    if (!path || !num_of_shards || num_of_shards > BPE_MAX_SHARDS || !encoding || !len)
+        return NULL;
+
+    char *text_buffer = get_file(path);
+    if (!text_buffer)
+        return NULL;
+
+    size_t text_size = strlen(text_buffer);
+    int fds[BPE_MAX_SHARDS];
+    pid_t pids[BPE_MAX_SHARDS];
+    size_t started = 0;
+    bool ok = true;
+
+    // buffered output would otherwise be written once more by every shard
+    fflush(NULL);
+
+    size_t slice_start = 0;
+    for (; started < num_of_shards; started++)
+    {
+        // slices end after a whitespace byte near the even split, so only pairs across word gaps go uncounted
+        size_t slice_end = started == num_of_shards - 1 ? text_size : (started + 1) * text_size / num_of_shards;
+        size_t next_split = started + 2 >= num_of_shards ? text_size : (started + 2) * text_size / num_of_shards;
+        slice_end = slice_end < slice_start ? slice_start : slice_end;
+        while (slice_end < next_split && slice_end > slice_start && text_buffer[slice_end - 1] != ' ' && text_buffer[slice_end - 1] != '\n')
+            slice_end++;
+
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+        {
+            perror("socketpair");
+            ok = false;
+            break;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            close(sv[0]);
+            close(sv[1]);
+            ok = false;
+            break;
+        }
+
+        if (!pid)
+        {
+            // the earlier shards' sockets stay open in this process otherwise, and they'd never see the coordinator go away
+            for (size_t shard = 0; shard < started; shard++)
+                close(fds[shard]);
+            close(sv[0]);
+            _exit(bpe_shard_serve(sv[1], (const uint8_t *)text_buffer + slice_start, slice_end - slice_start) ? EXIT_SUCCESS
+                                                                                                                 : EXIT_FAILURE);
+        }
+
+        close(sv[1]);
+        fds[started] = sv[0];
+        pids[started] = pid;
+        slice_start = slice_end;
+    }
+
+    dyn_arr_t *pair_arr = ok ? bpe_shard_coordinate(fds, num_of_shards, encoding, len, opts, stats) : NULL;
+    if (pair_arr && stats)
+        stats->input_bytes = text_size;
+
+    for (size_t shard = 0; shard < started; shard++)
+    {
+        close(fds[shard]);
+
+        int status;
+        if (waitpid(pids[shard], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+            ok = false;
+    }
+
+    if (!ok && pair_arr)
+    {
+        fprintf(stderr, "A shard failed\n");
+        dyn_arr_free(pair_arr);
+        free(*encoding);
+        *encoding = NULL;
+        pair_arr = NULL;
+    }
+
+    free(text_buffer);
+    return pair_arr;
+}
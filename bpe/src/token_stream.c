@@ -0,0 +1,320 @@
+#include "../inc/bpe.h"
+
+#define TOKEN_STREAM_MAGIC "BPETOKS1"
+#define TOKEN_STREAM_VERSION 1
+// packed bytes collected before each fwrite
+#define TOKEN_STREAM_CHUNK (64 * 1024)
+// the fixed width unpacker loads 8 bytes at any byte of the payload, this much zeroed slack follows it
+#define TOKEN_STREAM_SLACK 8
+
+// on disk layout: this header (host byte order like the checkpoints), table_len uint32_t ids when remapped,
+// then payload_len bytes of packed ids. varints are 7 bits a byte, low bits first; fixed width ids are
+// packed low bit first into a little endian bit stream
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint8_t mode;
+    uint8_t bits; // width of every id with BPE_PACK_FIXED, 0 with BPE_PACK_VARINT
+    uint8_t remapped;
+    uint8_t reserved;
+    uint64_t num_of_tokens;
+    uint64_t table_len; // packed id -> token, 0 without remap
+    uint64_t payload_len;
+} token_stream_header_t;
+
+typedef struct
+{
+    uint32_t token;
+    size_t count;
+} token_count_t;
+
+static int token_count_cmp(const void *a, const void *b)
+{
+    const token_count_t *one = (const token_count_t *)a;
+    const token_count_t *two = (const token_count_t *)b;
+    if (one->count != two->count)
+        return one->count < two->count ? 1 : -1;
+    return (one->token > two->token) - (one->token < two->token);
+}
+
+static inline size_t varint_len(uint32_t value)
+{
+    return value < (1U << 7) ? 1 : value < (1U << 14) ? 2 : value < (1U << 21) ? 3 : value < (1U << 28) ? 4 : 5;
+}
+
+static inline uint8_t bits_for(uint32_t max_id)
+{
+    uint8_t bits = 1;
+    while (bits < 32 && (max_id >> bits))
+        bits++;
+    return bits;
+}
+
+static inline uint64_t load_le64(const uint8_t *bytes)
+{
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+// builds the frequency sorted table of the tokens that occur and the token -> packed id map for it
+static bool build_remap(const uint32_t *tokens, size_t len, size_t vocab_size, uint32_t **table, size_t *table_len, uint32_t **ids)
+{
+    token_count_t *counts = (token_count_t *)malloc((vocab_size ? vocab_size : 1) * sizeof(token_count_t));
+    *ids = (uint32_t *)malloc((vocab_size ? vocab_size : 1) * sizeof(uint32_t));
+    *table = NULL;
+    if (!counts || !*ids)
+    {
+        free(counts);
+        free(*ids);
+        *ids = NULL;
+        return false;
+    }
+
+    for (size_t i = 0; i < vocab_size; i++)
+        counts[i] = (token_count_t){(uint32_t)i, 0};
+    for (size_t i = 0; i < len; i++)
+        counts[tokens[i]].count++;
+
+    qsort(counts, vocab_size, sizeof(token_count_t), token_count_cmp);
+
+    *table_len = 0;
+    while (*table_len < vocab_size && counts[*table_len].count)
+        (*table_len)++;
+
+    *table = (uint32_t *)malloc((*table_len ? *table_len : 1) * sizeof(uint32_t));
+    if (!*table)
+    {
+        free(counts);
+        free(*ids);
+        *ids = NULL;
+        return false;
+    }
+
+    for (size_t i = 0; i < *table_len; i++)
+    {
+        (*table)[i] = counts[i].token;
+        (*ids)[counts[i].token] = (uint32_t)i;
+    }
+
+    free(counts);
+    return true;
+}
+
+bool bpe_tokens_write(const char *path, const uint32_t *tokens, size_t len, size_t vocab_size, bpe_pack_mode_t mode, bool remap,
+                      size_t *bytes_written)
+{
+    if (!path || (!tokens && len) || !vocab_size || vocab_size > UINT32_MAX ||
+        (mode != BPE_PACK_VARINT && mode != BPE_PACK_FIXED))
+        return false;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (tokens[i] >= vocab_size)
+        {
+            fprintf(stderr, "Token %u at %zu is outside the vocabulary\n", tokens[i], i);
+            return false;
+        }
+    }
+
+    uint32_t *table = NULL, *ids = NULL;
+    size_t table_len = 0;
+    if (remap && !build_remap(tokens, len, vocab_size, &table, &table_len, &ids))
+        return false;
+
+    token_stream_header_t header = {
+        .version = TOKEN_STREAM_VERSION,
+        .mode = (uint8_t)mode,
+        .remapped = remap,
+        .num_of_tokens = len,
+        .table_len = table_len,
+    };
+    memcpy(header.magic, TOKEN_STREAM_MAGIC, sizeof(header.magic));
+
+    // the payload size goes in the header, so it is worked out before anything is written and the output can be a pipe
+    if (mode == BPE_PACK_FIXED)
+    {
+        header.bits = bits_for(remap ? (uint32_t)(table_len ? table_len - 1 : 0) : (uint32_t)(vocab_size - 1));
+        header.payload_len = ((uint64_t)len * header.bits + 7) / 8;
+    }
+    else
+    {
+        for (size_t i = 0; i < len; i++)
+            header.payload_len += varint_len(ids ? ids[tokens[i]] : tokens[i]);
+    }
+
+    FILE *file = fopen(path, "wb");
+    uint8_t *chunk = (uint8_t *)malloc(TOKEN_STREAM_CHUNK + 2 * sizeof(uint64_t));
+    if (!file || !chunk)
+    {
+        if (!file)
+            perror("fopen");
+        else
+            fclose(file);
+        free(chunk);
+        free(table);
+        free(ids);
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(table, sizeof(uint32_t), table_len, file) == table_len;
+
+    size_t pos = 0;
+    uint64_t acc = 0; // fixed width bits not written out yet
+    unsigned acc_bits = 0;
+    for (size_t i = 0; ok && i < len; i++)
+    {
+        uint32_t id = ids ? ids[tokens[i]] : tokens[i];
+        if (mode == BPE_PACK_FIXED)
+        {
+            acc |= (uint64_t)id << acc_bits;
+            acc_bits += header.bits;
+            while (acc_bits >= 8)
+            {
+                chunk[pos++] = (uint8_t)acc;
+                acc >>= 8;
+                acc_bits -= 8;
+            }
+        }
+        else
+        {
+            while (id >= 0x80)
+            {
+                chunk[pos++] = (uint8_t)(id | 0x80);
+                id >>= 7;
+            }
+            chunk[pos++] = (uint8_t)id;
+        }
+
+        if (pos >= TOKEN_STREAM_CHUNK)
+        {
+            ok = fwrite(chunk, 1, pos, file) == pos;
+            pos = 0;
+        }
+    }
+
+    if (acc_bits)
+        chunk[pos++] = (uint8_t)acc;
+    if (ok && pos)
+        ok = fwrite(chunk, 1, pos, file) == pos;
+
+    if (fclose(file))
+        ok = false;
+
+    if (ok && bytes_written)
+        *bytes_written = sizeof(header) + table_len * sizeof(uint32_t) + header.payload_len;
+
+    free(chunk);
+    free(table);
+    free(ids);
+    return ok;
+}
+
+static bool unpack_varint(const uint8_t *payload, size_t payload_len, uint32_t *out, size_t len)
+{
+    size_t pos = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        // most ids are a single byte once remapped
+        if (pos < payload_len && payload[pos] < 0x80)
+        {
+            out[i] = payload[pos++];
+            continue;
+        }
+
+        uint32_t id = 0;
+        unsigned shift = 0;
+        while (true)
+        {
+            if (pos >= payload_len || shift > 28)
+                return false;
+
+            uint8_t byte = payload[pos++];
+            id |= (uint32_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+            shift += 7;
+        }
+        out[i] = id;
+    }
+
+    return pos == payload_len;
+}
+
+static void unpack_fixed(const uint8_t *payload, uint8_t bits, uint32_t *out, size_t len)
+{
+    // one unaligned 8 byte load per id and no branches, so the compiler can unroll and vectorize it
+    uint64_t mask = ((uint64_t)1 << bits) - 1;
+    for (size_t i = 0; i < len; i++)
+    {
+        uint64_t bit = (uint64_t)i * bits;
+        out[i] = (uint32_t)((load_le64(payload + (bit >> 3)) >> (bit & 7)) & mask);
+    }
+}
+
+bool bpe_tokens_read(const char *path, uint32_t **tokens, size_t *len)
+{
+    if (!path || !tokens || !len)
+        return false;
+
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        perror("fopen");
+        return false;
+    }
+
+    token_stream_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TOKEN_STREAM_MAGIC, sizeof(header.magic)) ||
+        header.version != TOKEN_STREAM_VERSION || header.mode > BPE_PACK_FIXED || header.table_len > UINT32_MAX ||
+        header.num_of_tokens > SIZE_MAX / sizeof(uint32_t) ||
+        (header.mode == BPE_PACK_FIXED && (header.bits < 1 || header.bits > 32 ||
+                                           header.payload_len != (header.num_of_tokens * header.bits + 7) / 8)) ||
+        (header.remapped && !header.table_len && header.num_of_tokens))
+    {
+        fprintf(stderr, "%s is not a token stream\n", path);
+        fclose(file);
+        return false;
+    }
+
+    uint32_t *table = (uint32_t *)malloc((header.table_len ? header.table_len : 1) * sizeof(uint32_t));
+    uint8_t *payload = (uint8_t *)calloc(header.payload_len + TOKEN_STREAM_SLACK, 1);
+    *tokens = (uint32_t *)malloc((header.num_of_tokens ? header.num_of_tokens : 1) * sizeof(uint32_t));
+    bool ok = table && payload && *tokens && fread(table, sizeof(uint32_t), header.table_len, file) == header.table_len &&
+              fread(payload, 1, header.payload_len, file) == header.payload_len;
+    fclose(file);
+
+    if (ok && header.mode == BPE_PACK_FIXED)
+        unpack_fixed(payload, header.bits, *tokens, header.num_of_tokens);
+    else if (ok)
+        ok = unpack_varint(payload, header.payload_len, *tokens, header.num_of_tokens);
+
+    if (ok && header.remapped)
+    {
+        uint32_t bad = 0;
+        for (size_t i = 0; i < header.num_of_tokens; i++)
+        {
+            uint32_t id = (*tokens)[i];
+            bad |= id >= header.table_len;
+            (*tokens)[i] = table[id < header.table_len ? id : 0];
+        }
+        ok = !bad;
+    }
+
+    free(table);
+    free(payload);
+    if (!ok)
+    {
+        fprintf(stderr, "%s is truncated or corrupt\n", path);
+        free(*tokens);
+        *tokens = NULL;
+        return false;
+    }
+
+    *len = header.num_of_tokens;
+    return true;
+}
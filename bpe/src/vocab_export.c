@@ -0,0 +1,200 @@
+#include "../inc/bpe.h"
+
+#define VOCAB_MAGIC "BPEVOCB1"
+#define VOCAB_VERSION 1
+#define VOCAB_BUF_SIZE (64 * 1024)
+// the longest thing put_escaped writes for one byte, \u00XX
+#define VOCAB_MAX_ESCAPE 6
+
+// binary layout: this header, num_of_tokens uint32_t byte lengths, then the bytes of every token back to
+// back, in host byte order like the checkpoints
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t num_of_tokens;
+    uint64_t bytes_len;
+} vocab_header_t;
+
+// collects output into one buffer and hands it to stdio a block at a time
+typedef struct
+{
+    FILE *out;
+    size_t len;
+    bool ok;
+    char buf[VOCAB_BUF_SIZE];
+} vocab_writer_t;
+
+static void flush_writer(vocab_writer_t *writer)
+{
+    if (writer->ok && writer->len && fwrite(writer->buf, 1, writer->len, writer->out) != writer->len)
+        writer->ok = false;
+    writer->len = 0;
+}
+
+// makes room for len more bytes, anything longer than the buffer goes straight to stdio
+static inline bool reserve(vocab_writer_t *writer, size_t len)
+{
+    if (writer->len + len > VOCAB_BUF_SIZE)
+        flush_writer(writer);
+    return len <= VOCAB_BUF_SIZE;
+}
+
+static void put_bytes(vocab_writer_t *writer, const void *bytes, size_t len)
+{
+    if (!reserve(writer, len))
+    {
+        if (writer->ok && fwrite(bytes, 1, len, writer->out) != len)
+            writer->ok = false;
+        return;
+    }
+
+    memcpy(writer->buf + writer->len, bytes, len);
+    writer->len += len;
+}
+
+static inline void put_str(vocab_writer_t *writer, const char *str)
+{
+    put_bytes(writer, str, strlen(str));
+}
+
+static void put_uint(vocab_writer_t *writer, uint64_t value)
+{
+    char digits[20];
+    size_t len = 0;
+    do
+    {
+        digits[sizeof(digits) - ++len] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    put_bytes(writer, digits + sizeof(digits) - len, len);
+}
+
+// text escapes C style (\n, \\, \xff), json keeps to \uXXXX and leaves the only other escapes it has to it;
+// bytes above 0x7f are written as the code point of the same value, so a reader maps code points back to bytes
+static void put_escaped(vocab_writer_t *writer, const uint8_t *bytes, size_t len, bool json)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++)
+    {
+        reserve(writer, VOCAB_MAX_ESCAPE);
+        char *out = writer->buf + writer->len;
+        uint8_t byte = bytes[i];
+        char escape = byte == '\\' ? '\\' : byte == '\n' ? 'n' : byte == '\t' ? 't' : byte == '\r' ? 'r' : byte == '"' && json ? '"' : 0;
+        if (escape)
+        {
+            out[0] = '\\';
+            out[1] = escape;
+            writer->len += 2;
+        }
+        else if (byte >= 0x20 && byte < 0x7f)
+        {
+            out[0] = (char)byte;
+            writer->len++;
+        }
+        else if (json)
+        {
+            memcpy(out, "\\u00", 4);
+            out[4] = hex[byte >> 4];
+            out[5] = hex[byte & 0xf];
+            writer->len += 6;
+        }
+        else
+        {
+            out[0] = '\\';
+            out[1] = 'x';
+            out[2] = hex[byte >> 4];
+            out[3] = hex[byte & 0xf];
+            writer->len += 4;
+        }
+    }
+}
+
+static void export_text(const bpe_model_t *model, vocab_writer_t *writer, size_t first_token)
+{
+    for (size_t token = first_token; token < model->num_of_tokens; token++)
+    {
+        put_uint(writer, token);
+        put_str(writer, " => ");
+        put_escaped(writer, model->token_bytes + model->token_offset[token], model->token_len[token], false);
+        put_bytes(writer, "\n", 1);
+    }
+}
+
+static void export_json(const bpe_model_t *model, vocab_writer_t *writer, size_t first_token)
+{
+    put_str(writer, "{\"tokens\":[");
+    for (size_t token = first_token; token < model->num_of_tokens; token++)
+    {
+        put_str(writer, token == first_token ? "\n{\"id\":" : ",\n{\"id\":");
+        put_uint(writer, token);
+        put_str(writer, ",\"bytes\":\"");
+        put_escaped(writer, model->token_bytes + model->token_offset[token], model->token_len[token], true);
+        put_str(writer, "\"");
+
+        // the model doesn't require a contiguous table, so the pair is read through the generic accessor
+        pair_t pair;
+        if (token >= 256 && dyn_arr_get(model->pair_arr, token, &pair))
+        {
+            put_str(writer, ",\"pair\":[");
+            put_uint(writer, pair.a);
+            put_str(writer, ",");
+            put_uint(writer, pair.b);
+            put_str(writer, "]");
+        }
+
+        if (model->merge_freq && model->token_freq)
+        {
+            put_str(writer, ",\"merge_freq\":");
+            put_uint(writer, model->merge_freq[token]);
+            put_str(writer, ",\"token_freq\":");
+            put_uint(writer, model->token_freq[token]);
+        }
+        put_str(writer, "}");
+    }
+    put_str(writer, "\n]}\n");
+}
+
+static void export_binary(const bpe_model_t *model, vocab_writer_t *writer, size_t first_token)
+{
+    size_t first_byte = first_token < model->num_of_tokens ? model->token_offset[first_token] : model->bytes_len;
+    vocab_header_t header = {
+        .version = VOCAB_VERSION,
+        .num_of_tokens = model->num_of_tokens - first_token,
+        .bytes_len = model->bytes_len - first_byte,
+    };
+    memcpy(header.magic, VOCAB_MAGIC, sizeof(header.magic));
+
+    // token_bytes already holds the tokens back to back in id order, so both arrays go out as they are
+    put_bytes(writer, &header, sizeof(header));
+    put_bytes(writer, model->token_len + first_token, header.num_of_tokens * sizeof(uint32_t));
+    put_bytes(writer, model->token_bytes + first_byte, header.bytes_len);
+}
+
+bool bpe_vocab_export(const bpe_model_t *model, FILE *out, bpe_vocab_format_t format, size_t first_token)
+{
+    if (!model || !out || first_token > model->num_of_tokens)
+        return false;
+
+    vocab_writer_t *writer = (vocab_writer_t *)malloc(sizeof(vocab_writer_t));
+    if (!writer)
+        return false;
+
+    writer->out = out;
+    writer->len = 0;
+    writer->ok = true;
+
+    if (format == BPE_VOCAB_JSON)
+        export_json(model, writer, first_token);
+    else if (format == BPE_VOCAB_BINARY)
+        export_binary(model, writer, first_token);
+    else
+        export_text(model, writer, first_token);
+
+    flush_writer(writer);
+    bool ok = writer->ok && !fflush(out);
+    free(writer);
+    return ok;
+}
@@ -0,0 +1,100 @@
+#include "../inc/bpe.h"
+
+#include <math.h>
+
+// grows merge_freq to cover num_of_tokens, new entries start at 0
+static bool reserve_merges(bpe_vocab_stats_t *stats, size_t num_of_tokens)
+{
+    if (num_of_tokens <= stats->merge_cap)
+        return true;
+
+    size_t cap = stats->merge_cap * 2 > num_of_tokens ? stats->merge_cap * 2 : num_of_tokens;
+    cap = cap < 512 ? 512 : cap;
+    uint32_t *grown = (uint32_t *)realloc(stats->merge_freq, cap * sizeof(uint32_t));
+    if (!grown)
+        return false;
+
+    memset(grown + stats->merge_cap, 0, (cap - stats->merge_cap) * sizeof(uint32_t));
+    stats->merge_freq = grown;
+    stats->merge_cap = cap;
+    return true;
+}
+
+bool bpe_vocab_stats_record_merge(bpe_vocab_stats_t *stats, uint32_t token, uint32_t freq)
+{
+    if (!stats || !reserve_merges(stats, (size_t)token + 1))
+        return false;
+
+    stats->merge_freq[token] = freq;
+    return true;
+}
+
+bool bpe_vocab_stats_count_tokens(bpe_vocab_stats_t *stats, size_t num_of_tokens, const uint32_t *tokens, size_t len)
+{
+    // tokens no merge was recorded for (the bytes, loaded merges) keep a merge frequency of 0
+    if (!stats || !num_of_tokens || (!tokens && len) || !reserve_merges(stats, num_of_tokens))
+        return false;
+
+    size_t *token_freq = (size_t *)calloc(num_of_tokens, sizeof(size_t));
+    if (!token_freq)
+        return false;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (tokens[i] >= num_of_tokens)
+        {
+            free(token_freq);
+            return false;
+        }
+        token_freq[tokens[i]]++;
+    }
+
+    free(stats->token_freq);
+    stats->token_freq = token_freq;
+    stats->num_of_tokens = num_of_tokens;
+    stats->total_tokens = len;
+    return true;
+}
+
+void bpe_vocab_stats_free(bpe_vocab_stats_t *stats)
+{
+    if (!stats)
+        return;
+
+    free(stats->merge_freq);
+    free(stats->token_freq);
+    memset(stats, 0, sizeof(bpe_vocab_stats_t));
+}
+
+bool bpe_model_attach_stats(bpe_model_t *model, const bpe_vocab_stats_t *stats)
+{
+    if (!model || !stats || stats->num_of_tokens != model->num_of_tokens || !stats->token_freq || !stats->merge_freq)
+        return false;
+
+    uint32_t *merge_freq = (uint32_t *)malloc(model->num_of_tokens * sizeof(uint32_t));
+    size_t *token_freq = (size_t *)malloc(model->num_of_tokens * sizeof(size_t));
+    float *token_bits = (float *)malloc(model->num_of_tokens * sizeof(float));
+    if (!merge_freq || !token_freq || !token_bits)
+    {
+        free(merge_freq);
+        free(token_freq);
+        free(token_bits);
+        return false;
+    }
+
+    memcpy(merge_freq, stats->merge_freq, model->num_of_tokens * sizeof(uint32_t));
+    memcpy(token_freq, stats->token_freq, model->num_of_tokens * sizeof(size_t));
+
+    // an unused token is priced as if it had occurred once
+    double total = stats->total_tokens ? (double)stats->total_tokens : 1;
+    for (size_t i = 0; i < model->num_of_tokens; i++)
+        token_bits[i] = (float)-log2((token_freq[i] ? (double)token_freq[i] : 1) / total);
+
+    free(model->merge_freq);
+    free(model->token_freq);
+    free(model->token_bits);
+    model->merge_freq = merge_freq;
+    model->token_freq = token_freq;
+    model->token_bits = token_bits;
+    return true;
+}
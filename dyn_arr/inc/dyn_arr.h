@@ -4,8 +4,10 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
 
 #define MAX_NODE_SIZE (1U << 8)
+#define DYN_ARR_MAX_SORT_THREADS 64
 
 typedef struct
 {
@@ -13,6 +15,9 @@ typedef struct
     size_t last_index; // Index of the last element in the array
     size_t item_size;  // Size of each data item in bytes
     void **nodes;      // Array of node pointers
+    bool contiguous;   // Items live in one block at data instead of in nodes
+    void *data;        // Contiguous storage, only used when contiguous is set
+    size_t capacity;   // Number of items data can hold
 } dyn_arr_t;
 
 // Function pointer type for comparing two items
@@ -26,6 +31,38 @@ typedef bool (*dyn_compare_t)(const void *a, const void *b);
  */
 dyn_arr_t *dyn_arr_create(size_t min_size, size_t item_size);
 
+/**
+ * Creates a new dynamic array backed by a single block that doubles when it fills up
+ * Every other dyn_arr function works on it unchanged, and dyn_arr_data() exposes the block
+ * @param min_size Minimum capacity of the array
+ * @param item_size Size of each item in bytes
+ * @return Pointer to the new dynamic array, or NULL if allocation failed
+ */
+dyn_arr_t *dyn_arr_create_contiguous(size_t min_size, size_t item_size);
+
+/**
+ * Grows a contiguous array so it can hold at least capacity items without reallocating
+ * @param dyn_arr Pointer to the dynamic array
+ * @param capacity Number of items to make room for
+ * @return true if successful, false if allocation failed or the array is not contiguous
+ */
+bool dyn_arr_reserve(dyn_arr_t *dyn_arr, size_t capacity);
+
+/**
+ * Gets the contiguous storage of the array
+ * @param dyn_arr Pointer to the dynamic array
+ * @return Pointer to the first item, or NULL if the array is not contiguous
+ */
+void *dyn_arr_data(dyn_arr_t *dyn_arr);
+
+/**
+ * Gets a pointer to an item in place, without copying it
+ * @param dyn_arr Pointer to the dynamic array
+ * @param index Index of the item
+ * @return Pointer to the item, or NULL if the index is not backed by storage
+ */
+void *dyn_arr_at(dyn_arr_t *dyn_arr, size_t index);
+
 /**
  * Frees all memory associated with the dynamic array
  * @param dyn_arr Pointer to the dynamic array
@@ -53,15 +90,40 @@ bool dyn_arr_append(dyn_arr_t *dyn_arr, const void *item);
 bool dyn_arr_get(dyn_arr_t *dyn_arr, size_t index, void *output);
 
 /**
- * Sorts items in the dynamic array
+ * Sorts items in the dynamic array in place with an iterative introsort (not stable)
+ * Contiguous arrays are sorted where they are, paged arrays are gathered into one scratch block first
  * @param dyn_arr Pointer to the dynamic array
  * @param start_index Starting index (inclusive)
  * @param end_index Ending index (inclusive)
- * @param compare Comparison function that returns true if a should come before b
+ * @param compare Comparison function that returns true if a should come before b; a strict ordering (<) sorts
+ *                in O(n log n), a non strict one (<=) stays in bounds but may take longer
  * @return true if successful, false if allocation failed or indices are invalid
  */
 bool dyn_arr_sort(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, dyn_compare_t compare);
 
+/**
+ * Sorts items by a uint32_t field with a stable LSD radix sort, no comparator calls
+ * @param dyn_arr Pointer to the dynamic array
+ * @param start_index Starting index (inclusive)
+ * @param end_index Ending index (inclusive)
+ * @param key_offset Byte offset of the key inside each item, e.g. offsetof(pair_freq_t, freq)
+ * @param descending true to put the largest keys first
+ * @return true if successful, false if allocation failed or indices are invalid
+ */
+bool dyn_arr_sort_u32_key(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, size_t key_offset, bool descending);
+
+/**
+ * Sorts items using several threads: each sorts a slice, then the slices are merged pairwise
+ * Falls back to dyn_arr_sort for small ranges or a single thread
+ * @param dyn_arr Pointer to the dynamic array
+ * @param start_index Starting index (inclusive)
+ * @param end_index Ending index (inclusive)
+ * @param compare Comparison function that returns true if a should come before b
+ * @param thread_no Number of threads to use, capped at DYN_ARR_MAX_SORT_THREADS
+ * @return true if successful, false if allocation failed or indices are invalid
+ */
+bool dyn_arr_sort_parallel(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, dyn_compare_t compare, size_t thread_no);
+
 /**
  * Finds the maximum element in the range
  * @param dyn_arr Pointer to the dynamic array
@@ -84,4 +146,61 @@ bool dyn_arr_max(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, dyn_c
  */
 bool dyn_arr_min(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, dyn_compare_t is_less, void *output);
 
+/**
+ * Finds the minimum and maximum elements of the range in a single pass, without allocating
+ * @param dyn_arr Pointer to the dynamic array
+ * @param start_index Starting index (inclusive)
+ * @param end_index Ending index (inclusive)
+ * @param is_less Comparison function that returns true if a < b
+ * @param min_output Where the minimum item is copied, may be NULL
+ * @param max_output Where the maximum item is copied, may be NULL
+ * @return true if successful, false if indices are invalid
+ */
+bool dyn_arr_minmax(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, dyn_compare_t is_less, void *min_output, void *max_output);
+
+/**
+ * Finds the k largest elements of the range with a bounded heap kept in the caller's buffer
+ * @param dyn_arr Pointer to the dynamic array
+ * @param start_index Starting index (inclusive)
+ * @param end_index Ending index (inclusive)
+ * @param k Number of items to keep
+ * @param is_less Comparison function that returns true if a < b
+ * @param output Buffer of at least k items, filled largest first
+ * @param found Set to the number of items written, less than k when the range is shorter
+ * @return true if successful, false if indices are invalid
+ */
+bool dyn_arr_topk(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, size_t k, dyn_compare_t is_less, void *output, size_t *found);
+
+/**
+ * Generates type specialized inline accessors for arrays created with dyn_arr_create_contiguous
+ * DYN_ARR_DEFINE_TYPED(pair_vec, pair_t) defines pair_vec_data, pair_vec_at, pair_vec_get and pair_vec_set
+ * The accessors index the block directly and only fall back to the generic functions to grow it
+ */
+#define DYN_ARR_DEFINE_TYPED(name, type)                                         \
+    static inline type *name##_data(dyn_arr_t *dyn_arr)                          \
+    {                                                                            \
+        return (type *)dyn_arr->data;                                            \
+    }                                                                            \
+    static inline type *name##_at(dyn_arr_t *dyn_arr, size_t index)             \
+    {                                                                            \
+        return (type *)dyn_arr->data + index;                                    \
+    }                                                                            \
+    static inline type name##_get(dyn_arr_t *dyn_arr, size_t index)             \
+    {                                                                            \
+        return ((type *)dyn_arr->data)[index];                                   \
+    }                                                                            \
+    static inline bool name##_set(dyn_arr_t *dyn_arr, size_t index, type item)  \
+    {                                                                            \
+        if (index >= dyn_arr->capacity)                                          \
+        {                                                                        \
+            return dyn_arr_set(dyn_arr, index, &item);                           \
+        }                                                                        \
+        ((type *)dyn_arr->data)[index] = item;                                   \
+        if (index > dyn_arr->last_index)                                         \
+        {                                                                        \
+            dyn_arr->last_index = index;                                         \
+        }                                                                        \
+        return true;                                                             \
+    }
+
 #endif // DYN_ARR_H
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "../inc/dyn_arr.h"
 #include <math.h>
+#include <pthread.h>
 
 dyn_arr_t *dyn_arr_create(size_t min_size, size_t item_size)
 {
@@ -15,6 +16,10 @@ dyn_arr_t *dyn_arr_create(size_t min_size, size_t item_size)
     }
 
     dyn_arr->item_size = item_size;
+    dyn_arr->last_index = 0;
+    dyn_arr->contiguous = false;
+    dyn_arr->data = NULL;
+    dyn_arr->capacity = 0;
 
     if (!min_size)
     {
@@ -43,6 +48,78 @@ dyn_arr_t *dyn_arr_create(size_t min_size, size_t item_size)
     return dyn_arr;
 }
 
+dyn_arr_t *dyn_arr_create_contiguous(size_t min_size, size_t item_size)
+{
+    dyn_arr_t *dyn_arr = dyn_arr_create(0, item_size);
+    if (!dyn_arr)
+    {
+        return NULL;
+    }
+
+    dyn_arr->contiguous = true;
+    if (min_size && !dyn_arr_reserve(dyn_arr, min_size))
+    {
+        dyn_arr_free(dyn_arr);
+        return NULL;
+    }
+
+    return dyn_arr;
+}
+
+bool dyn_arr_reserve(dyn_arr_t *dyn_arr, size_t capacity)
+{
+    if (!dyn_arr || !dyn_arr->contiguous)
+    {
+        return false;
+    }
+
+    if (capacity <= dyn_arr->capacity)
+    {
+        return true;
+    }
+
+    void *temp = realloc(dyn_arr->data, capacity * dyn_arr->item_size);
+    if (!temp)
+    {
+        return false;
+    }
+
+    dyn_arr->data = temp;
+    dyn_arr->capacity = capacity;
+    return true;
+}
+
+void *dyn_arr_data(dyn_arr_t *dyn_arr)
+{
+    if (!dyn_arr || !dyn_arr->contiguous)
+    {
+        return NULL;
+    }
+
+    return dyn_arr->data;
+}
+
+void *dyn_arr_at(dyn_arr_t *dyn_arr, size_t index)
+{
+    if (!dyn_arr)
+    {
+        return NULL;
+    }
+
+    if (dyn_arr->contiguous)
+    {
+        return index < dyn_arr->capacity ? (char *)dyn_arr->data + index * dyn_arr->item_size : NULL;
+    }
+
+    size_t node_no = index / MAX_NODE_SIZE;
+    if (node_no >= dyn_arr->len || !dyn_arr->nodes[node_no])
+    {
+        return NULL;
+    }
+
+    return (char *)dyn_arr->nodes[node_no] + (index & (MAX_NODE_SIZE - 1)) * dyn_arr->item_size;
+}
+
 void dyn_arr_free(dyn_arr_t *dyn_arr)
 {
     if (!dyn_arr)
@@ -50,6 +127,13 @@ void dyn_arr_free(dyn_arr_t *dyn_arr)
         return;
     }
 
+    if (dyn_arr->contiguous)
+    {
+        free(dyn_arr->data);
+        free(dyn_arr);
+        return;
+    }
+
     for (size_t counter = 0; counter < dyn_arr->len; counter++)
     {
         free(dyn_arr->nodes[counter]);
@@ -66,6 +150,31 @@ bool dyn_arr_set(dyn_arr_t *dyn_arr, size_t index, const void *item)
         return false;
     }
 
+    if (dyn_arr->contiguous)
+    {
+        if (index >= dyn_arr->capacity)
+        {
+            // amortized doubling, with a small floor so tiny arrays don't realloc on every append
+            size_t new_capacity = dyn_arr->capacity ? dyn_arr->capacity * 2 : 16;
+            while (new_capacity <= index)
+            {
+                new_capacity *= 2;
+            }
+
+            if (!dyn_arr_reserve(dyn_arr, new_capacity))
+            {
+                return false;
+            }
+        }
+
+        memcpy((char *)dyn_arr->data + index * dyn_arr->item_size, item, dyn_arr->item_size);
+        if (index > dyn_arr->last_index)
+        {
+            dyn_arr->last_index = index;
+        }
+        return true;
+    }
+
     if (index > dyn_arr->last_index)
     {
         dyn_arr->last_index = index;
@@ -118,6 +227,17 @@ bool dyn_arr_get(dyn_arr_t *dyn_arr, size_t index, void *output)
         return false;
     }
 
+    if (dyn_arr->contiguous)
+    {
+        if (index >= dyn_arr->capacity)
+        {
+            return false;
+        }
+
+        memcpy(output, (char *)dyn_arr->data + index * dyn_arr->item_size, dyn_arr->item_size);
+        return true;
+    }
+
     size_t node_no = index / MAX_NODE_SIZE;
     size_t node_index = index & (MAX_NODE_SIZE - 1);
 
@@ -133,265 +253,588 @@ bool dyn_arr_get(dyn_arr_t *dyn_arr, size_t index, void *output)
     return true;
 }
 
-bool dyn_arr_max(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, dyn_compare_t is_less, void *output)
+#define INSERTION_SORT_CUTOFF 16
+#define PARALLEL_SORT_MIN_ITEMS (1U << 16)
+
+#define ITEM(base, index, size) ((char *)(base) + (index) * (size))
+
+static inline void item_swap(char *a, char *b, size_t size, char *tmp)
 {
-    if (!dyn_arr || !output || start_index > end_index)
+    memcpy(tmp, a, size);
+    memcpy(a, b, size);
+    memcpy(b, tmp, size);
+}
+
+static void insertion_sort(char *base, size_t lo, size_t hi, size_t size, dyn_compare_t compare, char *tmp)
+{
+    for (size_t i = lo + 1; i < hi; i++)
     {
-        return false;
+        if (!compare(ITEM(base, i, size), ITEM(base, i - 1, size)))
+            continue;
+
+        memcpy(tmp, ITEM(base, i, size), size);
+        size_t j = i;
+        while (j > lo && compare(tmp, ITEM(base, j - 1, size)))
+        {
+            memcpy(ITEM(base, j, size), ITEM(base, j - 1, size), size);
+            j--;
+        }
+        memcpy(ITEM(base, j, size), tmp, size);
     }
+}
 
-    void *max = malloc(dyn_arr->item_size);
-    if (!max)
+static void sift_down(char *base, size_t root, size_t len, size_t size, dyn_compare_t compare, char *tmp)
+{
+    while (2 * root + 1 < len)
     {
-        return false;
+        size_t child = 2 * root + 1;
+        if (child + 1 < len && compare(ITEM(base, child, size), ITEM(base, child + 1, size)))
+            child++;
+
+        if (!compare(ITEM(base, root, size), ITEM(base, child, size)))
+            return;
+
+        item_swap(ITEM(base, root, size), ITEM(base, child, size), size, tmp);
+        root = child;
     }
+}
 
-    void *temp = malloc(dyn_arr->item_size);
-    if (!temp)
+static void heap_sort(char *base, size_t len, size_t size, dyn_compare_t compare, char *tmp)
+{
+    for (size_t root = len / 2; root-- > 0;)
+        sift_down(base, root, len, size, compare, tmp);
+
+    for (size_t end = len; end-- > 1;)
     {
-        free(max);
-        return false;
+        item_swap(base, ITEM(base, end, size), size, tmp);
+        sift_down(base, 0, end, size, compare, tmp);
+    }
+}
+
+// sorts base[lo, hi) in place; tmp and pivot must each hold one item
+static void intro_sort(char *base, size_t lo, size_t hi, size_t size, dyn_compare_t compare, char *tmp, char *pivot)
+{
+    typedef struct
+    {
+        size_t lo, hi, depth;
+    } range_t;
+
+    // the smaller side is always handled first, so the stack never holds more than log2(n) ranges
+    range_t stack[64];
+    size_t top = 0;
+
+    size_t depth_limit = 0;
+    for (size_t n = hi - lo; n > 1; n >>= 1)
+        depth_limit += 2;
+
+    stack[top++] = (range_t){lo, hi, depth_limit};
+    while (top)
+    {
+        range_t range = stack[--top];
+
+        while (range.hi - range.lo > INSERTION_SORT_CUTOFF)
+        {
+            if (!range.depth)
+            {
+                heap_sort(ITEM(base, range.lo, size), range.hi - range.lo, size, compare, tmp);
+                range.hi = range.lo;
+                break;
+            }
+            range.depth--;
+
+            // median of three, so a strict comparator stops both scans below near the middle
+            size_t mid = range.lo + (range.hi - range.lo) / 2;
+            char *first = ITEM(base, range.lo, size);
+            char *middle = ITEM(base, mid, size);
+            char *last = ITEM(base, range.hi - 1, size);
+            if (compare(middle, first))
+                item_swap(middle, first, size, tmp);
+            if (compare(last, middle))
+            {
+                item_swap(last, middle, size, tmp);
+                if (compare(middle, first))
+                    item_swap(middle, first, size, tmp);
+            }
+            memcpy(pivot, middle, size);
+
+            size_t i = range.lo, j = range.hi - 1;
+            while (true)
+            {
+                // the scans are bounded too, a comparator that isn't strict (<= on equal keys) would run them off the ends
+                while (i < range.hi - 1 && compare(ITEM(base, i, size), pivot))
+                    i++;
+                while (j > range.lo && compare(pivot, ITEM(base, j, size)))
+                    j--;
+                if (i >= j)
+                    break;
+
+                item_swap(ITEM(base, i, size), ITEM(base, j, size), size, tmp);
+                i++;
+                j--;
+            }
+
+            // [lo, j] is never empty; [j + 1, hi) only can be with a comparator that isn't strict, and the depth
+            // limit then hands the range to heap_sort
+            range_t left = {range.lo, j + 1, range.depth};
+            range_t right = {j + 1, range.hi, range.depth};
+            if (left.hi - left.lo < right.hi - right.lo)
+            {
+                stack[top++] = right;
+                range = left;
+            }
+            else
+            {
+                stack[top++] = left;
+                range = right;
+            }
+        }
+
+        if (range.hi - range.lo > 1)
+            insertion_sort(base, range.lo, range.hi, size, compare, tmp);
     }
+}
 
-    if (!dyn_arr_get(dyn_arr, start_index, max))
+// copies the range of a paged array into (to_block) or out of (!to_block) a contiguous block
+static bool copy_range(dyn_arr_t *dyn_arr, size_t start_index, size_t len, char *block, bool to_block)
+{
+    for (size_t counter = 0; counter < len; counter++)
+    {
+        char *item = (char *)dyn_arr_at(dyn_arr, start_index + counter);
+        if (!item)
+            return false;
+
+        if (to_block)
+            memcpy(ITEM(block, counter, dyn_arr->item_size), item, dyn_arr->item_size);
+        else
+            memcpy(item, ITEM(block, counter, dyn_arr->item_size), dyn_arr->item_size);
+    }
+    return true;
+}
+
+bool dyn_arr_sort(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, dyn_compare_t compare)
+{
+    if (!dyn_arr || !compare || start_index > end_index)
     {
-        free(max);
-        free(temp);
         return false;
     }
 
-    for (size_t counter = start_index + 1; counter <= end_index; counter++)
+    if (start_index == end_index)
     {
-        if (!dyn_arr_get(dyn_arr, counter, temp))
+        return true;
+    }
+
+    size_t len = end_index - start_index + 1;
+    size_t size = dyn_arr->item_size;
+
+    if (dyn_arr->contiguous)
+    {
+        if (end_index >= dyn_arr->capacity)
         {
-            continue;
+            return false;
         }
 
-        if (is_less(max, temp))
+        char *scratch = (char *)malloc(2 * size);
+        if (!scratch)
         {
-            memcpy(max, temp, dyn_arr->item_size);
+            return false;
         }
+
+        intro_sort(ITEM(dyn_arr->data, start_index, size), 0, len, size, compare, scratch, scratch + size);
+        free(scratch);
+        return true;
     }
 
-    memcpy(output, max, dyn_arr->item_size);
+    // paged storage is gathered into one block, sorted there and scattered back
+    char *scratch = (char *)malloc((len + 2) * size);
+    if (!scratch)
+    {
+        return false;
+    }
 
-    free(max);
-    free(temp);
+    if (!copy_range(dyn_arr, start_index, len, scratch, true))
+    {
+        free(scratch);
+        return false;
+    }
+
+    intro_sort(scratch, 0, len, size, compare, ITEM(scratch, len, size), ITEM(scratch, len + 1, size));
+    copy_range(dyn_arr, start_index, len, scratch, false);
+    free(scratch);
     return true;
 }
 
-bool dyn_arr_min(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, dyn_compare_t is_less, void *output)
+bool dyn_arr_sort_u32_key(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, size_t key_offset, bool descending)
 {
-    if (!dyn_arr || !output || start_index > end_index)
+    if (!dyn_arr || start_index > end_index || key_offset + sizeof(uint32_t) > dyn_arr->item_size)
     {
         return false;
     }
 
-    void *min = malloc(dyn_arr->item_size);
-    if (!min)
+    size_t len = end_index - start_index + 1;
+    size_t size = dyn_arr->item_size;
+
+    if (dyn_arr->contiguous && end_index >= dyn_arr->capacity)
     {
         return false;
     }
 
-    void *temp = malloc(dyn_arr->item_size);
-    if (!temp)
+    // one block holds the ping pong buffer, plus the gathered copy when the array is paged
+    char *scratch = (char *)malloc((dyn_arr->contiguous ? 1 : 2) * len * size);
+    if (!scratch)
     {
-        free(min);
         return false;
     }
 
-    if (!dyn_arr_get(dyn_arr, start_index, min))
+    char *src = dyn_arr->contiguous ? ITEM(dyn_arr->data, start_index, size) : scratch + len * size;
+    char *dst = scratch;
+    char *const items = src;
+
+    if (!dyn_arr->contiguous && !copy_range(dyn_arr, start_index, len, items, true))
     {
-        free(min);
-        free(temp);
+        free(scratch);
         return false;
     }
 
-    for (size_t counter = start_index + 1; counter <= end_index; counter++)
+    size_t counts[4][256] = {{0}};
+    for (size_t i = 0; i < len; i++)
     {
-        if (!dyn_arr_get(dyn_arr, counter, temp))
+        uint32_t key;
+        memcpy(&key, ITEM(src, i, size) + key_offset, sizeof(uint32_t));
+        if (descending)
+            key = ~key;
+
+        for (size_t digit = 0; digit < 4; digit++)
+            counts[digit][(key >> (8 * digit)) & 0xff]++;
+    }
+
+    // least significant digit first, every pass is stable so ties keep their original order
+    for (size_t digit = 0; digit < 4; digit++)
+    {
+        size_t offsets[256];
+        size_t offset = 0;
+        bool single_bucket = false;
+        for (size_t bucket = 0; bucket < 256; bucket++)
         {
-            continue;
+            if (counts[digit][bucket] == len)
+                single_bucket = true;
+            offsets[bucket] = offset;
+            offset += counts[digit][bucket];
         }
 
-        if (is_less(temp, min))
+        // every key shares this digit, the pass would not move anything
+        if (single_bucket)
+            continue;
+
+        for (size_t i = 0; i < len; i++)
         {
-            memcpy(min, temp, dyn_arr->item_size);
+            uint32_t key;
+            memcpy(&key, ITEM(src, i, size) + key_offset, sizeof(uint32_t));
+            if (descending)
+                key = ~key;
+
+            memcpy(ITEM(dst, offsets[(key >> (8 * digit)) & 0xff]++, size), ITEM(src, i, size), size);
         }
+
+        char *swap = src;
+        src = dst;
+        dst = swap;
     }
 
-    memcpy(output, min, dyn_arr->item_size);
+    if (src != items)
+        memcpy(items, src, len * size);
 
-    free(min);
-    free(temp);
+    if (!dyn_arr->contiguous)
+        copy_range(dyn_arr, start_index, len, items, false);
+
+    free(scratch);
     return true;
 }
 
-bool dyn_arr_sort(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, dyn_compare_t compare)
+typedef struct
+{
+    char *base;
+    size_t lo, hi, size;
+    dyn_compare_t compare;
+    char *tmp; // two items of scratch
+} sort_task_t;
+
+typedef struct
+{
+    const char *src;
+    char *dst;
+    size_t lo, mid, hi, size;
+    dyn_compare_t compare;
+} merge_task_t;
+
+static void *sort_worker(void *arg)
+{
+    sort_task_t *task = (sort_task_t *)arg;
+    intro_sort(task->base, task->lo, task->hi, task->size, task->compare, task->tmp, task->tmp + task->size);
+    return NULL;
+}
+
+static void *merge_worker(void *arg)
+{
+    merge_task_t *task = (merge_task_t *)arg;
+    size_t size = task->size;
+    size_t left = task->lo, right = task->mid, out = task->lo;
+
+    while (left < task->mid && right < task->hi)
+    {
+        // take from the right only when strictly smaller, so equal items keep their run order
+        if (task->compare(ITEM(task->src, right, size), ITEM(task->src, left, size)))
+            memcpy(ITEM(task->dst, out++, size), ITEM(task->src, right++, size), size);
+        else
+            memcpy(ITEM(task->dst, out++, size), ITEM(task->src, left++, size), size);
+    }
+
+    memcpy(ITEM(task->dst, out, size), ITEM(task->src, left, size), (task->mid - left) * size);
+    out += task->mid - left;
+    memcpy(ITEM(task->dst, out, size), ITEM(task->src, right, size), (task->hi - right) * size);
+    return NULL;
+}
+
+bool dyn_arr_sort_parallel(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, dyn_compare_t compare, size_t thread_no)
 {
-    if (!dyn_arr || start_index > end_index)
+    if (!dyn_arr || !compare || start_index > end_index)
     {
         return false;
     }
 
-    if (start_index == end_index)
+    size_t len = end_index - start_index + 1;
+    if (thread_no > DYN_ARR_MAX_SORT_THREADS)
+        thread_no = DYN_ARR_MAX_SORT_THREADS;
+
+    if (thread_no <= 1 || len < PARALLEL_SORT_MIN_ITEMS)
     {
-        return true;
+        return dyn_arr_sort(dyn_arr, start_index, end_index, compare);
     }
 
-    if (start_index < end_index)
+    size_t size = dyn_arr->item_size;
+    if (dyn_arr->contiguous && end_index >= dyn_arr->capacity)
     {
-        size_t mid = start_index + (end_index - start_index) / 2;
+        return false;
+    }
 
-        if (!dyn_arr_sort(dyn_arr, start_index, mid, compare))
-        {
-            return false;
-        }
-        if (!dyn_arr_sort(dyn_arr, mid + 1, end_index, compare))
-        {
-            return false;
-        }
+    // layout: merge buffer, gathered copy for paged arrays, then two items of scratch per thread
+    size_t gathered = dyn_arr->contiguous ? 0 : len;
+    char *scratch = (char *)malloc((len + gathered + 2 * thread_no) * size);
+    if (!scratch)
+    {
+        return false;
+    }
 
-        size_t left_len = mid - start_index + 1;
-        size_t right_len = end_index - mid;
+    char *items = dyn_arr->contiguous ? ITEM(dyn_arr->data, start_index, size) : ITEM(scratch, len, size);
+    char *thread_tmp = ITEM(scratch, len + gathered, size);
 
-        void *left_temp = malloc(left_len * dyn_arr->item_size);
-        if (!left_temp)
-        {
-            return false;
-        }
-        void *right_temp = malloc(right_len * dyn_arr->item_size);
-        if (!right_temp)
+    if (!dyn_arr->contiguous && !copy_range(dyn_arr, start_index, len, items, true))
+    {
+        free(scratch);
+        return false;
+    }
+
+    size_t bounds[DYN_ARR_MAX_SORT_THREADS + 1];
+    for (size_t i = 0; i <= thread_no; i++)
+        bounds[i] = len * i / thread_no;
+
+    pthread_t threads[DYN_ARR_MAX_SORT_THREADS];
+    sort_task_t sort_tasks[DYN_ARR_MAX_SORT_THREADS];
+    bool ok = true;
+    for (size_t i = 0; i < thread_no; i++)
+    {
+        sort_tasks[i] = (sort_task_t){items, bounds[i], bounds[i + 1], size, compare, ITEM(thread_tmp, 2 * i, size)};
+        if (pthread_create(&threads[i], NULL, sort_worker, &sort_tasks[i]))
         {
-            free(left_temp);
-            return false;
+            // run it here instead, the result is the same
+            sort_worker(&sort_tasks[i]);
+            threads[i] = 0;
         }
+    }
+    for (size_t i = 0; i < thread_no; i++)
+    {
+        if (threads[i])
+            pthread_join(threads[i], NULL);
+    }
 
-        void *item_buffer = malloc(dyn_arr->item_size);
-        if (!item_buffer)
+    // merge neighbouring runs pairwise, one thread per merge, until a single run is left
+    char *src = items, *dst = scratch;
+    size_t runs = thread_no;
+    while (runs > 1)
+    {
+        merge_task_t merge_tasks[DYN_ARR_MAX_SORT_THREADS];
+        size_t merges = 0;
+        for (size_t run = 0; run < runs; run += 2)
         {
-            free(left_temp);
-            free(right_temp);
-            return false;
+            size_t hi = run + 2 <= runs ? bounds[run + 2] : bounds[run + 1];
+            size_t mid = run + 2 <= runs ? bounds[run + 1] : hi;
+            merge_tasks[merges++] = (merge_task_t){src, dst, bounds[run], mid, hi, size, compare};
         }
 
-        for (size_t counter = 0; counter < left_len; counter++)
+        for (size_t i = 0; i < merges; i++)
         {
-            if (!dyn_arr_get(dyn_arr, start_index + counter, item_buffer))
+            if (pthread_create(&threads[i], NULL, merge_worker, &merge_tasks[i]))
             {
-                free(left_temp);
-                free(right_temp);
-                free(item_buffer);
-                return false;
+                merge_worker(&merge_tasks[i]);
+                threads[i] = 0;
             }
-            memcpy((char *)left_temp + (counter * dyn_arr->item_size), item_buffer, dyn_arr->item_size);
         }
-
-        for (size_t counter = 0; counter < right_len; counter++)
+        for (size_t i = 0; i < merges; i++)
         {
-            if (!dyn_arr_get(dyn_arr, mid + 1 + counter, item_buffer))
-            {
-                free(left_temp);
-                free(right_temp);
-                free(item_buffer);
-                return false;
-            }
-            memcpy((char *)right_temp + (counter * dyn_arr->item_size), item_buffer, dyn_arr->item_size);
+            if (threads[i])
+                pthread_join(threads[i], NULL);
         }
 
-        size_t left_index = 0;
-        size_t right_index = 0;
-        size_t main_index = start_index;
+        size_t new_runs = 0;
+        for (size_t run = 0; run < runs; run += 2)
+            bounds[++new_runs] = run + 2 <= runs ? bounds[run + 2] : bounds[run + 1];
+        runs = new_runs;
+
+        char *swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    if (src != items)
+        memcpy(items, src, len * size);
 
-        void *left_item = malloc(dyn_arr->item_size);
-        void *right_item = malloc(dyn_arr->item_size);
+    if (!dyn_arr->contiguous)
+        ok = copy_range(dyn_arr, start_index, len, items, false);
 
-        if (!left_item || !right_item)
+    free(scratch);
+    return ok;
+}
+
+bool dyn_arr_max(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, dyn_compare_t is_less, void *output)
+{
+    return dyn_arr_minmax(dyn_arr, start_index, end_index, is_less, NULL, output);
+}
+
+bool dyn_arr_min(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, dyn_compare_t is_less, void *output)
+{
+    return dyn_arr_minmax(dyn_arr, start_index, end_index, is_less, output, NULL);
+}
+
+bool dyn_arr_minmax(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, dyn_compare_t is_less, void *min_output, void *max_output)
+{
+    if (!dyn_arr || !is_less || (!min_output && !max_output) || start_index > end_index)
+    {
+        return false;
+    }
+
+    // items are compared where they live, only the winners get copied out at the end
+    const void *min = dyn_arr_at(dyn_arr, start_index);
+    const void *max = min;
+    if (!min)
+    {
+        return false;
+    }
+
+    for (size_t counter = start_index + 1; counter <= end_index; counter++)
+    {
+        const void *item = dyn_arr_at(dyn_arr, counter);
+        if (!item)
         {
-            free(left_temp);
-            free(right_temp);
-            free(item_buffer);
-            free(left_item);
-            free(right_item);
-            return false;
+            continue;
         }
 
-        while (left_index < left_len && right_index < right_len)
+        if (is_less(item, min))
         {
-            memcpy(left_item, (char *)left_temp + (left_index * dyn_arr->item_size), dyn_arr->item_size);
-            memcpy(right_item, (char *)right_temp + (right_index * dyn_arr->item_size), dyn_arr->item_size);
-
-            if (compare(left_item, right_item))
-            {
-                if (!dyn_arr_set(dyn_arr, main_index++, left_item))
-                {
-                    free(left_temp);
-                    free(right_temp);
-                    free(item_buffer);
-                    free(left_item);
-                    free(right_item);
-                    return false;
-                }
-                left_index++;
-            }
-            else
-            {
-                if (!dyn_arr_set(dyn_arr, main_index++, right_item))
-                {
-                    free(left_temp);
-                    free(right_temp);
-                    free(item_buffer);
-                    free(left_temp);
-                    free(right_temp);
-                    free(item_buffer);
-                    free(left_item);
-                    free(right_item);
-                    return false;
-                }
-                right_index++;
-            }
+            min = item;
+        }
+        else if (is_less(max, item))
+        {
+            max = item;
         }
+    }
+
+    if (min_output)
+    {
+        memcpy(min_output, min, dyn_arr->item_size);
+    }
+    if (max_output)
+    {
+        memcpy(max_output, max, dyn_arr->item_size);
+    }
+    return true;
+}
 
-        while (left_index < left_len)
+static inline void item_swap_bytes(char *a, char *b, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        char byte = a[i];
+        a[i] = b[i];
+        b[i] = byte;
+    }
+}
+
+// min heap on is_less, the root is the smallest of the items kept so far
+static void topk_sift_down(char *heap, size_t root, size_t len, size_t size, dyn_compare_t is_less)
+{
+    while (2 * root + 1 < len)
+    {
+        size_t child = 2 * root + 1;
+        if (child + 1 < len && is_less(ITEM(heap, child + 1, size), ITEM(heap, child, size)))
+            child++;
+
+        if (!is_less(ITEM(heap, child, size), ITEM(heap, root, size)))
+            return;
+
+        item_swap_bytes(ITEM(heap, root, size), ITEM(heap, child, size), size);
+        root = child;
+    }
+}
+
+bool dyn_arr_topk(dyn_arr_t *dyn_arr, size_t start_index, size_t end_index, size_t k, dyn_compare_t is_less, void *output, size_t *found)
+{
+    if (!dyn_arr || !is_less || !output || !found || start_index > end_index)
+    {
+        return false;
+    }
+
+    size_t size = dyn_arr->item_size;
+    char *heap = (char *)output;
+    size_t len = 0;
+
+    for (size_t counter = start_index; counter <= end_index && k; counter++)
+    {
+        const char *item = (const char *)dyn_arr_at(dyn_arr, counter);
+        if (!item)
         {
-            memcpy(left_item, (char *)left_temp + (left_index * dyn_arr->item_size), dyn_arr->item_size);
-            if (!dyn_arr_set(dyn_arr, main_index++, left_item))
-            {
-                free(left_temp);
-                free(right_temp);
-                free(item_buffer);
-                free(left_item);
-                free(right_item);
-                return false;
-            }
-            left_index++;
+            continue;
         }
 
-        while (right_index < right_len)
+        if (len < k)
         {
-            memcpy(right_item, (char *)right_temp + (right_index * dyn_arr->item_size), dyn_arr->item_size);
-            if (!dyn_arr_set(dyn_arr, main_index++, right_item))
+            // sift up
+            size_t child = len++;
+            memcpy(ITEM(heap, child, size), item, size);
+            while (child && is_less(ITEM(heap, child, size), ITEM(heap, (child - 1) / 2, size)))
             {
-                free(left_temp);
-                free(right_temp);
-                free(item_buffer);
-                free(left_item);
-                free(right_item);
-                return false;
+                item_swap_bytes(ITEM(heap, child, size), ITEM(heap, (child - 1) / 2, size), size);
+                child = (child - 1) / 2;
             }
-            right_index++;
         }
+        else if (is_less(heap, item))
+        {
+            memcpy(heap, item, size);
+            topk_sift_down(heap, 0, len, size, is_less);
+        }
+    }
 
-        free(left_temp);
-        free(right_temp);
-        free(item_buffer);
-        free(left_item);
-        free(right_item);
+    // popping the min heap into its own tail leaves the largest item first
+    for (size_t end = len; end-- > 1;)
+    {
+        item_swap_bytes(heap, ITEM(heap, end, size), size);
+        topk_sift_down(heap, 0, end, size, is_less);
     }
 
+    *found = len;
     return true;
 }
 
+#undef ITEM
+
 bool dyn_arr_append(dyn_arr_t *dyn_arr, const void *item)
 {
     if (!dyn_arr || !item)
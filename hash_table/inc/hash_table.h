@@ -9,6 +9,7 @@ typedef struct node
 {
     void *key;
     void *value;
+    uint32_t hash; // full hash of key, kept so resizes and merges never rehash
     bool is_free;
     struct node *next;
 } node_t;
@@ -17,15 +18,32 @@ typedef bool (*hash_value_add)(const void *val_one, const void *val_two, const v
 
 typedef struct
 {
-    size_t num_of_buckets; // number of buckets you want in the hashtable
+    size_t num_of_buckets; // number of buckets in the hashtable, rounded up to a power of two
     size_t key_size;
     size_t value_size;
     node_t **buckets;   // each bucket is a linked list of nodes
     node_t *free_nodes; // list of free nodes that can be reused
     size_t num_of_nodes;
+    size_t resize_count; // number of times the bucket array was doubled
+    size_t lookups;      // searches and inserts, only counted when built with HASH_TABLE_INSTRUMENT
+    size_t probes;       // nodes compared across those lookups
 
 } hash_table_t;
 
+typedef struct
+{
+    size_t num_of_buckets;
+    size_t num_of_nodes;
+    size_t used_buckets;    // buckets with at least one node
+    double load_factor;     // nodes per bucket
+    size_t max_chain_len;
+    double avg_chain_len;   // average over the non empty buckets
+    size_t resize_count;
+    size_t free_nodes;      // nodes parked on the free list
+    size_t bytes_allocated; // table, bucket array, live and free nodes with their keys and values
+    double avg_probe_len;   // nodes compared per lookup, 0 unless built with HASH_TABLE_INSTRUMENT
+} hash_table_stats_t;
+
 hash_table_t *hash_table_create(size_t num_of_buckets, size_t key_size, size_t value_size); // number of buckets you want in the hashtable
                                                                                             // each bucket is a linked list of nodes
 void hash_table_destroy(hash_table_t *table);
@@ -33,7 +51,16 @@ void hash_table_destroy(hash_table_t *table);
 bool hash_table_insert(hash_table_t *table, const void *key, const void *value);
 bool hash_table_delete(hash_table_t *table, const void *key);
 bool hash_table_search(hash_table_t *table, const void *key, void *value);
+// adds value onto the stored value with add_value (result aliases val_one), or inserts it if the key is new
+bool hash_table_upsert(hash_table_t *table, const void *key, const void *value, hash_value_add add_value);
 bool hash_table_clear(hash_table_t *table);
+// cleared and deleted nodes stay on the free list for reuse, this caps how many are kept
+size_t hash_table_trim(hash_table_t *table, size_t max_free_nodes);
+bool hash_table_stats(const hash_table_t *table, hash_table_stats_t *stats);
+// the hash the table buckets keys by, for callers that shard keys across several tables
+uint32_t hash_table_hash(const void *key, size_t key_size);
 hash_table_t *hash_table_merge(hash_table_t **hash_table_arr, size_t len, hash_value_add add_value, size_t key_size, size_t value_size, size_t new_bucket_num);
+// same as hash_table_merge but adds into an existing table, so a cleared table can be reused every round
+bool hash_table_merge_into(hash_table_t *dst, hash_table_t **hash_table_arr, size_t len, hash_value_add add_value);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef SHARDED_HASH_TABLE_H
+#define SHARDED_HASH_TABLE_H
+
+#include <pthread.h>
+
+#include "hash_table.h"
+
+// one lock per shard, padded so threads working on neighbouring shards don't share a cache line
+typedef struct
+{
+    pthread_mutex_t lock;
+    hash_table_t *table;
+} __attribute__((aligned(64))) hash_table_shard_t;
+
+// a hash table many threads can update at once, keys are spread over shards by hash
+// and only the shard a key lands in is locked while it is updated
+typedef struct
+{
+    size_t num_of_shards;
+    size_t key_size;
+    size_t value_size;
+    hash_table_shard_t *shards;
+} sharded_hash_table_t;
+
+sharded_hash_table_t *sharded_hash_table_create(size_t num_of_shards, size_t buckets_per_shard, size_t key_size, size_t value_size);
+void sharded_hash_table_destroy(sharded_hash_table_t *table);
+
+// thread safe
+bool sharded_hash_table_upsert(sharded_hash_table_t *table, const void *key, const void *value, hash_value_add add_value);
+bool sharded_hash_table_search(sharded_hash_table_t *table, const void *key, void *value);
+
+// not thread safe, only call these while no other thread is updating the table
+bool sharded_hash_table_clear(sharded_hash_table_t *table);
+size_t sharded_hash_table_size(const sharded_hash_table_t *table);
+// shard stats summed up, chain lengths and probe counts are over all the shards
+bool sharded_hash_table_stats(const sharded_hash_table_t *table, hash_table_stats_t *stats);
+
+#endif
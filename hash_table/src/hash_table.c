@@ -5,6 +5,15 @@
 #define SEED 0x9747b28c
 #define BUCKET_DOUBLING_CUTOFF (0.3)
 
+#ifdef HASH_TABLE_INSTRUMENT
+// searches only read the table, so several threads may be counting into the same one
+#define PROBE_COUNT_LOOKUP(table) ((void)__atomic_fetch_add(&(table)->lookups, 1, __ATOMIC_RELAXED))
+#define PROBE_COUNT_NODE(table) ((void)__atomic_fetch_add(&(table)->probes, 1, __ATOMIC_RELAXED))
+#else
+#define PROBE_COUNT_LOOKUP(table) ((void)0)
+#define PROBE_COUNT_NODE(table) ((void)0)
+#endif
+
 static inline uint32_t hash_murmur3_32(const void *key, size_t key_size)
 {
     const uint8_t *data = (const uint8_t *)key;
@@ -52,14 +61,66 @@ static inline uint32_t hash_murmur3_32(const void *key, size_t key_size)
     return h;
 }
 
+// multiply-xorshift finalizer for keys that fit in a register, mixes every input bit into the low bits
+// that the bucket mask keeps
+static inline uint32_t hash_u64(uint64_t x)
+{
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93ULL;
+    x ^= x >> 32;
+    return (uint32_t)x;
+}
+
+static inline uint32_t hash_key(const void *key, size_t key_size)
+{
+    // fixed width keys (pair_t, uint32_t, pointers) skip murmur's block loop and tail switch
+    switch (key_size)
+    {
+    case sizeof(uint64_t):
+    {
+        uint64_t x;
+        memcpy(&x, key, sizeof(x));
+        return hash_u64(x);
+    }
+    case sizeof(uint32_t):
+    {
+        uint32_t x;
+        memcpy(&x, key, sizeof(x));
+        return hash_u64(x);
+    }
+    default:
+        return hash_murmur3_32(key, key_size);
+    }
+}
+
+static inline size_t round_up_pow2(size_t n)
+{
+    size_t pow2 = 1;
+    while (pow2 < n)
+        pow2 <<= 1;
+    return pow2;
+}
+
+// the bucket count is always a power of two, so this replaces a division
+#define BUCKET_OF(table, hash) ((hash) & ((table)->num_of_buckets - 1))
+
+static inline node_t *find_node(hash_table_t *table, const void *key, uint32_t hash);
+static bool insert_hashed(hash_table_t *table, const void *key, const void *value, uint32_t hash);
+static bool append_node(hash_table_t *table, const void *key, const void *value, uint32_t hash);
+
+uint32_t hash_table_hash(const void *key, size_t key_size)
+{
+    return hash_key(key, key_size);
+}
+
 hash_table_t *hash_table_create(size_t num_of_buckets, size_t key_size, size_t value_size)
 {
     hash_table_t *table = malloc(sizeof(hash_table_t));
     if (!table)
         return NULL;
 
-    table->num_of_buckets = num_of_buckets;
-    table->buckets = calloc(num_of_buckets, sizeof(node_t *));
+    table->num_of_buckets = round_up_pow2(num_of_buckets);
+    table->buckets = calloc(table->num_of_buckets, sizeof(node_t *));
     if (!table->buckets)
     {
         free(table);
@@ -70,6 +131,9 @@ hash_table_t *hash_table_create(size_t num_of_buckets, size_t key_size, size_t v
     table->key_size = key_size;
     table->free_nodes = NULL;
     table->num_of_nodes = 0;
+    table->resize_count = 0;
+    table->lookups = 0;
+    table->probes = 0;
 
     return table;
 }
@@ -113,34 +177,35 @@ hash_table_t *hash_table_merge(hash_table_t **hash_table_arr, size_t len, hash_v
         return NULL;
     }
 
-    for (size_t index = 0; index < len; index++)
-    {
-        hash_table_t *table = hash_table_arr[index];
-        if (!table || (table->key_size != key_size) || (table->value_size != value_size))
-        {
-            return NULL;
-        }
-    }
-
     hash_table_t *merged_table = hash_table_create(new_bucket_num, key_size, value_size);
     if (!merged_table)
     {
         return NULL;
     }
 
-    uint8_t *value = (uint8_t *)malloc(value_size);
-    if (!value)
+    if (!hash_table_merge_into(merged_table, hash_table_arr, len, add_value))
     {
         hash_table_destroy(merged_table);
         return NULL;
     }
 
-    uint8_t *new_val = (uint8_t *)malloc(value_size);
-    if (!new_val)
+    return merged_table;
+}
+
+bool hash_table_merge_into(hash_table_t *dst, hash_table_t **hash_table_arr, size_t len, hash_value_add add_value)
+{
+    if (!dst || !hash_table_arr || !add_value)
     {
-        free(value);
-        hash_table_destroy(merged_table);
-        return NULL;
+        return false;
+    }
+
+    for (size_t index = 0; index < len; index++)
+    {
+        hash_table_t *table = hash_table_arr[index];
+        if (!table || (table->key_size != dst->key_size) || (table->value_size != dst->value_size))
+        {
+            return false;
+        }
     }
 
     for (size_t index = 0; index < len; index++)
@@ -148,48 +213,23 @@ hash_table_t *hash_table_merge(hash_table_t **hash_table_arr, size_t len, hash_v
         hash_table_t *table = hash_table_arr[index];
         for (size_t counter = 0; counter < table->num_of_buckets; counter++)
         {
-            node_t *curr = table->buckets[counter];
-            while (curr)
+            for (node_t *curr = table->buckets[counter]; curr; curr = curr->next)
             {
-                if (!curr->is_free)
+                if (curr->is_free)
+                    continue;
+
+                // all tables hash keys the same way, so the source node's cached hash is reused
+                node_t *existing = find_node(dst, curr->key, curr->hash);
+                if (existing ? !add_value(existing->value, curr->value, existing->value)
+                             : !append_node(dst, curr->key, curr->value, curr->hash))
                 {
-                    if (!hash_table_search(merged_table, curr->key, (void *)value))
-                    {
-                        if (!hash_table_insert(merged_table, curr->key, curr->value))
-                        {
-                            free(value);
-                            free(new_val);
-                            hash_table_destroy(merged_table);
-                            return NULL;
-                        }
-                    }
-                    else
-                    {
-                        if (!add_value((void *)value, curr->value, (void *)new_val))
-                        {
-                            free(value);
-                            free(new_val);
-                            hash_table_destroy(merged_table);
-                            return NULL;
-                        }
-
-                        if (!hash_table_insert(merged_table, curr->key, new_val))
-                        {
-                            free(value);
-                            free(new_val);
-                            hash_table_destroy(merged_table);
-                            return NULL;
-                        }
-                    }
+                    return false;
                 }
-                curr = curr->next;
             }
         }
     }
 
-    free(value);
-    free(new_val);
-    return merged_table;
+    return true;
 }
 
 bool hash_table_resize(hash_table_t *table, size_t new_bucket_count)
@@ -197,6 +237,8 @@ bool hash_table_resize(hash_table_t *table, size_t new_bucket_count)
     if (!table || new_bucket_count <= 0)
         return false;
 
+    new_bucket_count = round_up_pow2(new_bucket_count);
+
     node_t **new_buckets = calloc(new_bucket_count, sizeof(node_t *));
     if (!new_buckets)
         return false;
@@ -214,8 +256,8 @@ bool hash_table_resize(hash_table_t *table, size_t new_bucket_count)
 
             if (!current->is_free)
             {
-                // calculate new hash based on new bucket count
-                unsigned long new_hash = hash_murmur3_32(current->key, table->key_size) % new_bucket_count;
+                // the hash is cached in the node, only the bucket changes
+                size_t new_hash = current->hash & (new_bucket_count - 1);
 
                 // insert at beginning of new bucket chain
                 current->next = new_buckets[new_hash];
@@ -236,34 +278,50 @@ bool hash_table_resize(hash_table_t *table, size_t new_bucket_count)
     free(old_buckets);
     table->buckets = new_buckets;
     table->num_of_buckets = new_bucket_count;
+    table->resize_count++;
 
     return true;
 }
 
-bool hash_table_insert(hash_table_t *table, const void *key, const void *value)
+static inline node_t *find_node(hash_table_t *table, const void *key, uint32_t hash)
 {
-    if (!table || !key || !value)
-        return false;
-
-    if (table->num_of_nodes >= BUCKET_DOUBLING_CUTOFF * table->num_of_buckets)
+    PROBE_COUNT_LOOKUP(table);
+    node_t *current = table->buckets[BUCKET_OF(table, hash)];
+    while (current)
     {
-        if (!hash_table_resize(table, table->num_of_buckets * 2))
+        PROBE_COUNT_NODE(table);
+        // the cached hash rules out almost every other key without touching its key buffer
+        if (current->hash == hash && !memcmp(current->key, key, table->key_size))
         {
-            // rehashing failed will lead to a performance degrade
+            return current;
         }
+        current = current->next;
     }
 
-    unsigned long hash = hash_murmur3_32(key, table->key_size) % table->num_of_buckets;
+    return NULL;
+}
 
-    node_t *current = table->buckets[hash];
-    while (current)
+static bool insert_hashed(hash_table_t *table, const void *key, const void *value, uint32_t hash)
+{
+    node_t *current = find_node(table, key, hash);
+    if (current)
     {
-        if (!current->is_free && !memcmp(current->key, key, table->key_size))
+        memcpy(current->value, value, table->value_size);
+        return true;
+    }
+
+    return append_node(table, key, value, hash);
+}
+
+// adds a node for a key known not to be in the table
+static bool append_node(hash_table_t *table, const void *key, const void *value, uint32_t hash)
+{
+    if (table->num_of_nodes >= BUCKET_DOUBLING_CUTOFF * table->num_of_buckets)
+    {
+        if (!hash_table_resize(table, table->num_of_buckets * 2))
         {
-            memcpy(current->value, value, table->value_size);
-            return true;
+            // rehashing failed will lead to a performance degrade
         }
-        current = current->next;
     }
 
     node_t *new_node = NULL;
@@ -297,15 +355,65 @@ bool hash_table_insert(hash_table_t *table, const void *key, const void *value)
     memcpy(new_node->key, key, table->key_size);
     memcpy(new_node->value, value, table->value_size);
 
-    new_node->next = table->buckets[hash];
+    size_t bucket = BUCKET_OF(table, hash);
+    new_node->hash = hash;
+    new_node->next = table->buckets[bucket];
     new_node->is_free = false;
-    table->buckets[hash] = new_node;
+    table->buckets[bucket] = new_node;
 
     table->num_of_nodes++;
 
     return true;
 }
 
+bool hash_table_insert(hash_table_t *table, const void *key, const void *value)
+{
+    if (!table || !key || !value)
+        return false;
+
+    return insert_hashed(table, key, value, hash_key(key, table->key_size));
+}
+
+bool hash_table_upsert(hash_table_t *table, const void *key, const void *value, hash_value_add add_value)
+{
+    if (!table || !key || !value || !add_value)
+        return false;
+
+    // one probe for both the hit and the miss, instead of a search followed by an insert
+    uint32_t hash = hash_key(key, table->key_size);
+    node_t *current = find_node(table, key, hash);
+    if (current)
+        return add_value(current->value, value, current->value);
+
+    return append_node(table, key, value, hash);
+}
+
+// frees nodes off the free list until at most max_free_nodes are left, returns how many were freed
+size_t hash_table_trim(hash_table_t *table, size_t max_free_nodes)
+{
+    if (!table)
+        return 0;
+
+    node_t **link = &table->free_nodes;
+    for (size_t kept = 0; *link && kept < max_free_nodes; kept++)
+        link = &(*link)->next;
+
+    size_t freed = 0;
+    node_t *current = *link;
+    *link = NULL;
+    while (current)
+    {
+        node_t *next = current->next;
+        free(current->key);
+        free(current->value);
+        free(current);
+        current = next;
+        freed++;
+    }
+
+    return freed;
+}
+
 // marks all the entries in the table as free
 bool hash_table_clear(hash_table_t *table)
 {
@@ -344,14 +452,15 @@ bool hash_table_delete(hash_table_t *table, const void *key)
     if (!table || !key)
         return false;
 
-    unsigned long hash = hash_murmur3_32(key, table->key_size) % table->num_of_buckets;
+    uint32_t key_hash = hash_key(key, table->key_size);
+    size_t hash = BUCKET_OF(table, key_hash);
 
     node_t *current = table->buckets[hash];
     node_t *prev = NULL;
 
     while (current)
     {
-        if (!current->is_free && !memcmp(current->key, key, table->key_size))
+        if (current->hash == key_hash && !memcmp(current->key, key, table->key_size))
         {
             if (prev)
             {
@@ -383,18 +492,49 @@ bool hash_table_search(hash_table_t *table, const void *key, void *value)
     if (!table || !key || !value)
         return false;
 
-    unsigned long hash = hash_murmur3_32(key, table->key_size) % table->num_of_buckets;
+    node_t *current = find_node(table, key, hash_key(key, table->key_size));
+    if (!current)
+        return false;
 
-    node_t *current = table->buckets[hash];
-    while (current)
+    memcpy(value, current->value, table->value_size);
+    return true;
+}
+
+bool hash_table_stats(const hash_table_t *table, hash_table_stats_t *stats)
+{
+    if (!table || !stats)
+        return false;
+
+    memset(stats, 0, sizeof(hash_table_stats_t));
+    stats->num_of_buckets = table->num_of_buckets;
+    stats->num_of_nodes = table->num_of_nodes;
+    stats->resize_count = table->resize_count;
+
+    size_t chained_nodes = 0;
+    for (size_t i = 0; i < table->num_of_buckets; i++)
     {
-        if (!current->is_free && !memcmp(current->key, key, table->key_size))
-        {
-            memcpy(value, current->value, table->value_size);
-            return true;
-        }
-        current = current->next;
+        size_t chain_len = 0;
+        for (node_t *current = table->buckets[i]; current; current = current->next)
+            chain_len++;
+
+        if (chain_len)
+            stats->used_buckets++;
+        if (chain_len > stats->max_chain_len)
+            stats->max_chain_len = chain_len;
+        chained_nodes += chain_len;
     }
 
-    return false;
-}
\ No newline at end of file
+    for (node_t *current = table->free_nodes; current; current = current->next)
+        stats->free_nodes++;
+
+    stats->load_factor = table->num_of_buckets ? (double)table->num_of_nodes / table->num_of_buckets : 0;
+    stats->avg_chain_len = stats->used_buckets ? (double)chained_nodes / stats->used_buckets : 0;
+
+    size_t node_bytes = sizeof(node_t) + table->key_size + table->value_size;
+    stats->bytes_allocated = sizeof(hash_table_t) + table->num_of_buckets * sizeof(node_t *) +
+                             (chained_nodes + stats->free_nodes) * node_bytes;
+
+    stats->avg_probe_len = table->lookups ? (double)table->probes / table->lookups : 0;
+
+    return true;
+}
@@ -0,0 +1,144 @@
+#include "../inc/sharded_hash_table.h"
+
+#include <string.h>
+
+// maps the hash onto [0, num_of_shards) using its high bits, the shard tables bucket by the low bits
+#define SHARD_OF(table, hash) ((size_t)(((uint64_t)(hash) * (table)->num_of_shards) >> 32))
+
+sharded_hash_table_t *sharded_hash_table_create(size_t num_of_shards, size_t buckets_per_shard, size_t key_size, size_t value_size)
+{
+    if (!num_of_shards)
+        return NULL;
+
+    sharded_hash_table_t *table = malloc(sizeof(sharded_hash_table_t));
+    if (!table)
+        return NULL;
+
+    table->shards = aligned_alloc(sizeof(hash_table_shard_t), num_of_shards * sizeof(hash_table_shard_t));
+    if (!table->shards)
+    {
+        free(table);
+        return NULL;
+    }
+
+    table->num_of_shards = num_of_shards;
+    table->key_size = key_size;
+    table->value_size = value_size;
+
+    for (size_t i = 0; i < num_of_shards; i++)
+    {
+        table->shards[i].table = hash_table_create(buckets_per_shard, key_size, value_size);
+        if (!table->shards[i].table || pthread_mutex_init(&table->shards[i].lock, NULL))
+        {
+            hash_table_destroy(table->shards[i].table);
+            table->num_of_shards = i;
+            sharded_hash_table_destroy(table);
+            return NULL;
+        }
+    }
+
+    return table;
+}
+
+void sharded_hash_table_destroy(sharded_hash_table_t *table)
+{
+    if (!table)
+        return;
+
+    for (size_t i = 0; i < table->num_of_shards; i++)
+    {
+        pthread_mutex_destroy(&table->shards[i].lock);
+        hash_table_destroy(table->shards[i].table);
+    }
+
+    free(table->shards);
+    free(table);
+}
+
+bool sharded_hash_table_upsert(sharded_hash_table_t *table, const void *key, const void *value, hash_value_add add_value)
+{
+    if (!table || !key || !value || !add_value)
+        return false;
+
+    hash_table_shard_t *shard = &table->shards[SHARD_OF(table, hash_table_hash(key, table->key_size))];
+
+    pthread_mutex_lock(&shard->lock);
+    bool rv = hash_table_upsert(shard->table, key, value, add_value);
+    pthread_mutex_unlock(&shard->lock);
+
+    return rv;
+}
+
+bool sharded_hash_table_search(sharded_hash_table_t *table, const void *key, void *value)
+{
+    if (!table || !key || !value)
+        return false;
+
+    hash_table_shard_t *shard = &table->shards[SHARD_OF(table, hash_table_hash(key, table->key_size))];
+
+    pthread_mutex_lock(&shard->lock);
+    bool rv = hash_table_search(shard->table, key, value);
+    pthread_mutex_unlock(&shard->lock);
+
+    return rv;
+}
+
+bool sharded_hash_table_clear(sharded_hash_table_t *table)
+{
+    if (!table)
+        return false;
+
+    for (size_t i = 0; i < table->num_of_shards; i++)
+    {
+        if (!hash_table_clear(table->shards[i].table))
+            return false;
+    }
+
+    return true;
+}
+
+size_t sharded_hash_table_size(const sharded_hash_table_t *table)
+{
+    if (!table)
+        return 0;
+
+    size_t size = 0;
+    for (size_t i = 0; i < table->num_of_shards; i++)
+        size += table->shards[i].table->num_of_nodes;
+
+    return size;
+}
+
+bool sharded_hash_table_stats(const sharded_hash_table_t *table, hash_table_stats_t *stats)
+{
+    if (!table || !stats)
+        return false;
+
+    memset(stats, 0, sizeof(hash_table_stats_t));
+    stats->bytes_allocated = sizeof(sharded_hash_table_t) + table->num_of_shards * sizeof(hash_table_shard_t);
+
+    size_t lookups = 0, probes = 0;
+    for (size_t i = 0; i < table->num_of_shards; i++)
+    {
+        hash_table_stats_t shard_stats;
+        hash_table_stats(table->shards[i].table, &shard_stats);
+
+        stats->num_of_buckets += shard_stats.num_of_buckets;
+        stats->num_of_nodes += shard_stats.num_of_nodes;
+        stats->used_buckets += shard_stats.used_buckets;
+        stats->resize_count += shard_stats.resize_count;
+        stats->free_nodes += shard_stats.free_nodes;
+        stats->bytes_allocated += shard_stats.bytes_allocated;
+        if (shard_stats.max_chain_len > stats->max_chain_len)
+            stats->max_chain_len = shard_stats.max_chain_len;
+
+        lookups += table->shards[i].table->lookups;
+        probes += table->shards[i].table->probes;
+    }
+
+    stats->load_factor = stats->num_of_buckets ? (double)stats->num_of_nodes / stats->num_of_buckets : 0;
+    stats->avg_chain_len = stats->used_buckets ? (double)stats->num_of_nodes / stats->used_buckets : 0;
+    stats->avg_probe_len = lookups ? (double)probes / lookups : 0;
+
+    return true;
+}
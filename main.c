@@ -4,7 +4,7 @@ int main(int argc, char **argv)
 {
     if (argc < 2)
     {
-        fprintf(stderr, "Usage: %s <file_path>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <file_path> [tokens_out]\n", argv[0]);
         return EXIT_FAILURE;
     }
 
@@ -17,9 +17,18 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
-    print_text(text, text_len);
+    int status = EXIT_SUCCESS;
+    if (argc > 2)
+    {
+        if (!bpe_tokens_write(argv[2], text, text_len, pair_arr->last_index + 1, BPE_PACK_VARINT, true, NULL))
+            status = EXIT_FAILURE;
+    }
+    else
+    {
+        print_text(text, text_len);
+    }
 
     free(text);
     dyn_arr_free(pair_arr);
-    return EXIT_SUCCESS;
+    return status;
 }
\ No newline at end of file